@@ -0,0 +1,308 @@
+// End-to-end install benchmark against a local mock registry.
+//
+// Generates projects whose packages.toml each lists hundreds of the
+// packages served by a MockRegistry, and installs their dependencies
+// through Dependencies::install, once with an empty cache (cold) and
+// once more into empty directories from the archives the first pass
+// cached (warm). Projects share the cache, as on a developer machine, so
+// the cold pass downloads a package once for all of them. Reports wall time, per-package latency percentiles, how much the
+// peak RSS grew during the pass, bytes written and I/O syscall counts. A
+// last pass downloads every archive through Fetch::get_all and reports
+// how its download window moved.
+//
+//   lpm-install-bench [--projects N] [--dependencies N]
+//                     [--packages N] [--files N] [--file-size BYTES]
+//                     [--latency-ms N] [--bandwidth BYTES_PER_SECOND]
+//                     [--error-rate P] [--drop-rate P] [--jobs N]
+//                     [--workdir PATH]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mock_registry.h"
+#include "dependencies.h"
+#include "fetch.h"
+#include "stats.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct Options {
+        LPM::Bench::RegistryOptions registry;
+        size_t projects = 4, dependencies = 300;
+        unsigned jobs = 1;
+        std::string workdir = "lpm-install-bench";
+
+        Options() {
+            registry.packages = 600;
+        }
+    };
+
+    struct Project {
+        fs::path path;
+        std::map<std::string, std::string> dependencies;
+    };
+
+    // Each project depends on its own random pick of the registry's
+    // packages, read back from the packages.toml written for it
+    std::vector<Project> make_projects(const LPM::Bench::MockRegistry& registry, const Options& options) {
+        std::mt19937 random(options.registry.seed);
+        std::vector<Project> projects;
+
+        for (size_t i = 0; i < options.projects; i++) {
+            std::vector<std::string> names = registry.names;
+            std::shuffle(names.begin(), names.end(), random);
+            names.resize(std::min(options.dependencies, names.size()));
+
+            fs::path path = fs::path(options.workdir) / "projects" / ("project" + std::to_string(i));
+            fs::create_directories(path);
+
+            std::ofstream manifest(path / "packages.toml");
+            manifest << "[project]\nname = \"project" << i << "\"\nversion = \"0.1.0\"\n\n[dependencies]\n";
+            for (auto& name : names) {
+                manifest << name << " = \"1.0\"\n";
+            }
+            manifest.close();
+
+            LPM::Manifests::Packages packages((path / "packages.toml").string());
+            projects.push_back(Project { path, std::move(packages.dependencies) });
+        }
+
+        return projects;
+    }
+
+    // syscr/syscw and write_bytes from /proc/self/io, zeros elsewhere
+    std::map<std::string, std::uint64_t> process_io() {
+        std::map<std::string, std::uint64_t> io;
+        std::ifstream file("/proc/self/io");
+        std::string key;
+        std::uint64_t value;
+
+        while (file >> key >> value) {
+            key.pop_back(); // trailing ':'
+            io[key] = value;
+        }
+
+        return io;
+    }
+
+    // A field of /proc/self/status in KiB (VmRSS, VmHWM...), -1 elsewhere
+    long status_kb(const std::string& field) {
+        std::ifstream file("/proc/self/status");
+        std::string key;
+
+        while (file >> key) {
+            long value;
+            if (key == field + ":" && file >> value) {
+                return value;
+            }
+        }
+
+        return -1;
+    }
+
+    // Restart the peak RSS from the current one (Linux 4.0 and later),
+    // otherwise VmHWM is a high-water mark of the whole process
+    bool reset_peak_rss() {
+        std::ofstream file("/proc/self/clear_refs");
+        file << "5";
+        file.flush();
+
+        return file.good();
+    }
+
+    bool parse(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; i++) {
+            std::string flag = argv[i];
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << flag << std::endl;
+                return false;
+            }
+
+            std::string value = argv[++i];
+
+            if (flag == "--projects") options.projects = std::stoul(value);
+            else if (flag == "--dependencies") options.dependencies = std::stoul(value);
+            else if (flag == "--packages") options.registry.packages = std::stoul(value);
+            else if (flag == "--files") options.registry.files_per_package = std::stoul(value);
+            else if (flag == "--file-size") options.registry.file_size = std::stoul(value);
+            else if (flag == "--latency-ms") options.registry.latency_ms = std::stoul(value);
+            else if (flag == "--bandwidth") options.registry.bandwidth_bytes_per_second = std::stoull(value);
+            else if (flag == "--error-rate") options.registry.error_rate = std::stod(value);
+            else if (flag == "--drop-rate") options.registry.drop_rate = std::stod(value);
+            else if (flag == "--jobs") options.jobs = std::max(1ul, std::stoul(value));
+            else if (flag == "--workdir") options.workdir = value;
+            else {
+                std::cerr << "Unknown option " << flag << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void run(
+        const std::string& label,
+        LPM::Bench::MockRegistry& registry,
+        const std::vector<Project>& projects,
+        const Options& options
+    ) {
+        LPM::Stats::reset();
+        bool peak_reset = reset_peak_rss();
+        long rss_before = status_kb("VmRSS");
+        auto io_before = process_io();
+        auto started = std::chrono::steady_clock::now();
+
+        // One project after the other, each one's dependencies spread
+        // over the jobs
+        std::vector<std::pair<const Project*, const LPM::Dependencies::Dependency*>> installs;
+        for (auto& project : projects) {
+            for (auto& dependency : project.dependencies) {
+                installs.emplace_back(&project, &dependency);
+            }
+        }
+
+        std::atomic<size_t> next { 0 };
+        auto worker = [&]() {
+            for (size_t i = next++; i < installs.size(); i = next++) {
+                auto& dependency = *installs[i].second;
+                const std::string& name = dependency.first;
+
+                LPM::Manifests::Repository::Package package {
+                    name, "", "zip", { { dependency.second, registry.url(name) } }
+                };
+
+                // Named like Cache::archive_path(), so the warm pass finds it
+                std::string error;
+                LPM::Dependencies::install(
+                    dependency,
+                    package,
+                    (fs::path(options.workdir) / "cache" / (name + "-" + dependency.second + ".zip")).string(),
+                    (installs[i].first->path / "lpm_modules" / name).string(),
+                    error
+                );
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < options.jobs; i++) {
+            workers.emplace_back(worker);
+        }
+
+        worker();
+        for (auto& thread : workers) {
+            thread.join();
+        }
+
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        auto io_after = process_io();
+        auto latencies = LPM::Stats::install_latencies();
+        auto& counters = LPM::Stats::counters();
+        long peak = status_kb("VmHWM");
+
+        std::cout
+            << label << ":\n"
+            << "  wall time          " << wall << " s\n"
+            << "  installed          " << counters.installs << " (" << counters.failed_installs << " failed)\n"
+            << "  from cache         " << counters.cache_hits << "\n"
+            << "  p50 latency        " << LPM::Stats::quantile(latencies, 0.50) * 1000 << " ms\n"
+            << "  p99 latency        " << LPM::Stats::quantile(latencies, 0.99) * 1000 << " ms\n"
+            << "  requests           " << counters.requests << " (" << counters.failed_requests << " failed)\n"
+            << "  bytes downloaded   " << counters.bytes_downloaded << "\n"
+            << "  files written      " << counters.files_written << "\n"
+            << "  bytes written      " << counters.bytes_written << "\n"
+            << "  directories made   " << counters.directories_created << "\n"
+            << "  zero-copy bytes    " << counters.zero_copy_bytes << "\n"
+            << "  disk write bytes   " << io_after["write_bytes"] - io_before["write_bytes"] << "\n"
+            << "  read syscalls      " << io_after["syscr"] - io_before["syscr"] << "\n"
+            << "  write syscalls     " << io_after["syscw"] - io_before["syscw"] << "\n"
+            << "  peak RSS growth    ";
+
+        if (peak_reset && peak >= 0 && rss_before >= 0) {
+            std::cout << peak - rss_before << " KiB\n";
+        } else {
+            std::cout << "unavailable\n";
+        }
+    }
+
+    void fetch(LPM::Bench::MockRegistry& registry) {
+        LPM::Stats::reset();
+        auto started = std::chrono::steady_clock::now();
+
+        std::vector<LPM::Fetch::Request> requests;
+        for (auto& name : registry.names) {
+            requests.push_back(LPM::Fetch::Request { registry.url(name), {} });
+        }
+
+        size_t failed = 0;
+        for (auto& response : LPM::Fetch::get_all(requests)) {
+            failed += response.status_code != 200;
+        }
+
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        auto& counters = LPM::Stats::counters();
+
+        std::cout
+            << "fetch:\n"
+            << "  wall time          " << wall << " s\n"
+            << "  downloaded         " << requests.size() - failed << " (" << failed << " failed)\n"
+            << "  requests           " << counters.requests << " (" << counters.fetch_retries << " retries)\n"
+            << "  final window       " << counters.fetch_window << "\n"
+            << "  window decisions   +" << counters.fetch_increases << " -" << counters.fetch_decreases
+            << " =" << counters.fetch_holds << "\n"
+            << "  window changes    ";
+
+        for (auto& change : LPM::Stats::window_changes()) {
+            std::cout << " " << change.window << " (" << change.reason << ")";
+        }
+
+        std::cout << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse(argc, argv, options)) {
+        return 1;
+    }
+
+    fs::remove_all(options.workdir);
+    fs::create_directories(fs::path(options.workdir) / "cache");
+
+    LPM::Bench::MockRegistry registry(options.registry);
+    auto projects = make_projects(registry, options);
+
+    std::cout
+        << "registry on port " << registry.port() << ": "
+        << options.registry.packages << " packages of "
+        << options.registry.files_per_package << " x "
+        << options.registry.file_size << " bytes, "
+        << projects.size() << " projects of " << std::min(options.dependencies, registry.names.size())
+        << " dependencies, " << options.jobs << " install jobs\n";
+
+    run("cold", registry, projects, options);
+
+    // Same installs from scratch, but every archive is in the cache now
+    for (auto& project : projects) {
+        fs::remove_all(project.path / "lpm_modules");
+    }
+    run("warm", registry, projects, options);
+    fetch(registry);
+
+    std::cout
+        << "registry served " << registry.requests << " requests, "
+        << registry.bytes_sent << " bytes, "
+        << registry.injected_errors << " injected errors\n";
+
+    fs::remove_all(options.workdir);
+
+    return 0;
+}
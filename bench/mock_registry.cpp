@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "mock_registry.h"
+
+namespace {
+    uint32_t crc32(const std::string& data) {
+        static uint32_t table[256];
+        static bool initialized = false;
+
+        if (!initialized) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                table[i] = c;
+            }
+            initialized = true;
+        }
+
+        uint32_t crc = 0xFFFFFFFFu;
+        for (unsigned char byte : data) {
+            crc = table[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+        }
+
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    void put16(std::string& out, uint16_t value) {
+        out.push_back(static_cast<char>(value));
+        out.push_back(static_cast<char>(value >> 8));
+    }
+
+    void put32(std::string& out, uint32_t value) {
+        put16(out, static_cast<uint16_t>(value));
+        put16(out, static_cast<uint16_t>(value >> 16));
+    }
+
+    // Contents of a file under root, refusing paths that leave it
+    bool read_under(const std::string& root, const std::string& path, std::string& content) {
+        if (root.empty() || path.empty() || path[0] != '/' || path.find("..") != std::string::npos) {
+            return false;
+        }
+
+        std::ifstream file(root + path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+
+        std::stringstream stream;
+        stream << file.rdbuf();
+        content = stream.str();
+
+        return true;
+    }
+
+    // Value of a request header, empty if the request has none
+    std::string header(const std::string& head, const std::string& name) {
+        size_t start = head.find("\r\n" + name + ": ");
+        if (start == std::string::npos) {
+            return "";
+        }
+
+        start += name.size() + 4;
+        return head.substr(start, head.find("\r\n", start) - start);
+    }
+
+    bool send_all(int socket, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+
+            data += sent;
+            size -= sent;
+        }
+
+        return true;
+    }
+}
+
+std::string LPM::Bench::make_zip(const std::map<std::string, std::string>& files) {
+    std::string archive, directory;
+
+    for (auto& file : files) {
+        uint32_t offset = static_cast<uint32_t>(archive.size());
+        uint32_t crc = crc32(file.second);
+        uint32_t size = static_cast<uint32_t>(file.second.size());
+
+        put32(archive, 0x04034b50);
+        put16(archive, 20);         // version needed
+        put16(archive, 0);          // flags
+        put16(archive, 0);          // stored
+        put16(archive, 0);          // time
+        put16(archive, 0x21);       // date (1980-01-01)
+        put32(archive, crc);
+        put32(archive, size);
+        put32(archive, size);
+        put16(archive, static_cast<uint16_t>(file.first.size()));
+        put16(archive, 0);          // extra length
+        archive += file.first;
+        archive += file.second;
+
+        put32(directory, 0x02014b50);
+        put16(directory, 20);       // version made by
+        put16(directory, 20);       // version needed
+        put16(directory, 0);
+        put16(directory, 0);
+        put16(directory, 0);
+        put16(directory, 0x21);
+        put32(directory, crc);
+        put32(directory, size);
+        put32(directory, size);
+        put16(directory, static_cast<uint16_t>(file.first.size()));
+        put16(directory, 0);        // extra length
+        put16(directory, 0);        // comment length
+        put16(directory, 0);        // disk
+        put16(directory, 0);        // internal attributes
+        put32(directory, 0);        // external attributes
+        put32(directory, offset);
+        directory += file.first;
+    }
+
+    uint32_t directory_offset = static_cast<uint32_t>(archive.size());
+    archive += directory;
+
+    put32(archive, 0x06054b50);
+    put16(archive, 0);
+    put16(archive, 0);
+    put16(archive, static_cast<uint16_t>(files.size()));
+    put16(archive, static_cast<uint16_t>(files.size()));
+    put32(archive, static_cast<uint32_t>(directory.size()));
+    put32(archive, directory_offset);
+    put16(archive, 0);
+
+    return archive;
+}
+
+LPM::Bench::MockRegistry::MockRegistry(const RegistryOptions& options) : options(options) {
+    std::mt19937 random(options.seed);
+
+    for (size_t i = 0; i < options.packages; i++) {
+        std::string name = "package" + std::to_string(i);
+        std::map<std::string, std::string> files;
+
+        for (size_t j = 0; j < options.files_per_package; j++) {
+            std::string content(options.file_size, '\0');
+            for (auto& c : content) {
+                c = static_cast<char>('a' + random() % 26);
+            }
+
+            std::string path = j == 0 ? "init.lua" : "lib/module" + std::to_string(j) + ".lua";
+            files.emplace(path, std::move(content));
+        }
+
+        archives.emplace("/packages/" + name + ".zip", make_zip(files));
+        names.push_back(name);
+    }
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw std::runtime_error("Failed to create registry socket");
+    }
+
+    int enable = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t length = sizeof(address);
+    if (
+        bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 512) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0
+    ) {
+        close(listener);
+        throw std::runtime_error("Failed to listen on 127.0.0.1");
+    }
+
+    _port = ntohs(address.sin_port);
+    acceptor = std::thread(&MockRegistry::accept_loop, this);
+}
+
+LPM::Bench::MockRegistry::~MockRegistry() {
+    stopping = true;
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    acceptor.join();
+
+    // Wake up connections idling in recv on a kept-alive socket
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (int client : clients) {
+            shutdown(client, SHUT_RDWR);
+        }
+    }
+
+    for (auto& connection : connections) {
+        connection.join();
+    }
+
+    for (int client : clients) {
+        close(client);
+    }
+}
+
+std::string LPM::Bench::MockRegistry::url(const std::string& name) const {
+    return root_url() + "/packages/" + name + ".zip";
+}
+
+std::string LPM::Bench::MockRegistry::root_url() const {
+    return "http://127.0.0.1:" + std::to_string(_port);
+}
+
+void LPM::Bench::MockRegistry::accept_loop() {
+    unsigned seed = options.seed;
+
+    while (!stopping) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+
+        int enable = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.push_back(client);
+        }
+
+        connections.emplace_back(&MockRegistry::serve, this, client, ++seed);
+    }
+}
+
+// Connections only shut their socket down, closing is left to the
+// destructor so a descriptor is never reused while still listed
+void LPM::Bench::MockRegistry::serve(int client, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::string buffer;
+    char chunk[4096];
+
+    while (!stopping) {
+        // Read one request head, bodies are never sent to us
+        size_t end;
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                shutdown(client, SHUT_RDWR);
+                return;
+            }
+
+            buffer.append(chunk, received);
+        }
+
+        std::string head = buffer.substr(0, end);
+        buffer.erase(0, end + 4);
+        requests++;
+
+        size_t path_start = head.find(' ') + 1;
+        std::string path = head.substr(path_start, head.find(' ', path_start) - path_start);
+
+        if (options.latency_ms > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.latency_ms));
+        }
+
+        if (chance(random) < options.drop_rate) {
+            injected_errors++;
+            shutdown(client, SHUT_RDWR);
+            return;
+        }
+
+        std::string status = "200 OK", extra_headers, file;
+        const std::string* body = nullptr;
+        static const std::string empty;
+
+        auto archive = archives.find(path);
+        if (chance(random) < options.error_rate) {
+            injected_errors++;
+            status = "503 Service Unavailable";
+            body = &empty;
+        } else if (archive != archives.end()) {
+            body = &archive->second;
+        } else if (read_under(options.root, path, file)) {
+            std::string etag = "\"" + std::to_string(std::hash<std::string>()(file)) + "\"";
+            extra_headers = "ETag: " + etag + "\r\n";
+
+            if (header(head, "If-None-Match") == etag) {
+                not_modified++;
+                status = "304 Not Modified";
+                body = &empty;
+            } else {
+                body = &file;
+            }
+        } else {
+            status = "404 Not Found";
+            body = &empty;
+        }
+
+        std::string response_head =
+            "HTTP/1.1 " + status + "\r\n"
+            "Content-Type: application/zip\r\n"
+            "Content-Length: " + std::to_string(body->size()) + "\r\n" +
+            extra_headers +
+            "Connection: keep-alive\r\n\r\n";
+
+        if (!send_all(client, response_head.data(), response_head.size())) {
+            break;
+        }
+
+        // Without shaping the body goes out in one call, otherwise in
+        // slices paced to the configured bandwidth
+        size_t slice = options.bandwidth_bytes_per_second > 0
+            ? std::max<size_t>(1024, options.bandwidth_bytes_per_second / 100)
+            : body->size();
+
+        for (size_t offset = 0; offset < body->size(); offset += slice) {
+            size_t size = std::min(slice, body->size() - offset);
+            if (!send_all(client, body->data() + offset, size)) {
+                shutdown(client, SHUT_RDWR);
+                return;
+            }
+
+            bytes_sent += size;
+
+            if (options.bandwidth_bytes_per_second > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(
+                    size * 1000000 / options.bandwidth_bytes_per_second
+                ));
+            }
+        }
+    }
+
+    shutdown(client, SHUT_RDWR);
+}
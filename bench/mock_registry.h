@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LPM::Bench {
+    struct RegistryOptions {
+        size_t packages = 200;
+        size_t files_per_package = 20;
+        size_t file_size = 4096;
+
+        // Added before every response, and the rate bodies are sent at
+        // (0 means unlimited)
+        unsigned latency_ms = 0;
+        std::uint64_t bandwidth_bytes_per_second = 0;
+
+        // Share of requests answered with a 503, and of connections
+        // dropped before answering
+        double error_rate = 0;
+        double drop_rate = 0;
+
+        unsigned seed = 1;
+
+        // Directory whose files are served as well, under their relative
+        // path and with an ETag, e.g. a generated sparse repository
+        std::string root;
+    };
+
+    // A stand-in for a package registry, serving generated zip archives
+    // over plain HTTP/1.1 on 127.0.0.1:
+    //
+    //   /packages/<name>.zip
+    //   /<path>                 files under options.root
+    //
+    // Each connection gets its own thread and is kept alive.
+    class MockRegistry {
+    public:
+        MockRegistry(const RegistryOptions& options);
+        ~MockRegistry();
+
+        MockRegistry(const MockRegistry&) = delete;
+        MockRegistry& operator=(const MockRegistry&) = delete;
+
+        RegistryOptions options;
+
+        // Names of the generated packages
+        std::vector<std::string> names;
+
+        std::string url(const std::string& name) const;
+
+        // Url of options.root
+        std::string root_url() const;
+        int port() const { return _port; }
+
+        std::atomic<std::uint64_t>
+            requests { 0 }, bytes_sent { 0 }, injected_errors { 0 }, not_modified { 0 };
+    private:
+        std::map<std::string, std::string> archives;
+        int listener = -1, _port = 0;
+        std::atomic<bool> stopping { false };
+        std::thread acceptor;
+        std::vector<std::thread> connections;
+        std::mutex clients_mutex;
+        std::vector<int> clients;
+
+        void accept_loop();
+        void serve(int client, unsigned seed);
+    };
+
+    // A zip archive holding the given files, stored uncompressed
+    std::string make_zip(const std::map<std::string, std::string>& files);
+}
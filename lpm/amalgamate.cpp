@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <vector>
+#include "amalgamate.h"
+#include "macros.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    // The payload offset is only known once the prologue is complete, so
+    // it gets a fixed width and is patched in afterwards
+    const char* BASE_PLACEHOLDER = "${payload_offset}";
+    const int BASE_WIDTH = 12;
+
+    const char* BUNDLE_LOADER = R"lua(
+local self = debug.getinfo(1, "S").source:sub(2)
+local load = _VERSION == "Lua 5.1" and loadstring or load
+local file
+
+local function chunk(entry)
+    file = file or assert(io.open(self, "rb"))
+    assert(file:seek("set", base + entry[1]))
+    return assert(load(file:read(entry[2]), entry[3]))
+end
+
+for name, entry in pairs(modules) do
+    package.preload[name] = function(...)
+        return chunk(entry)(...)
+    end
+end
+
+return chunk(main)(...)
+)lua";
+
+    struct Chunk {
+        std::string file, chunk_name;
+        uint64_t offset = 0, size = 0;
+    };
+
+    // Lua modules of the project itself, found next to main the same way
+    // ./?.lua would find them
+    void project_modules(
+        const fs::path& root,
+        const fs::path& modules_path,
+        const std::vector<fs::path>& excluded,
+        std::map<std::string, std::string>& modules
+    ) {
+        for (
+            auto entry = fs::recursive_directory_iterator(root);
+            entry != fs::recursive_directory_iterator();
+            ++entry
+        ) {
+            fs::path path = entry->path().lexically_normal();
+
+            if (entry->is_directory() && (
+                path.filename().string()[0] == '.' || path == modules_path
+            )) {
+                entry.disable_recursion_pending();
+                continue;
+            }
+
+            if (
+                !entry->is_regular_file() ||
+                std::find(excluded.begin(), excluded.end(), path) != excluded.end()
+            ) {
+                continue;
+            }
+
+            std::string name, alias;
+            std::string relative = path.lexically_relative(root).generic_string();
+            if (!LPM::Modules::module_names(relative, name, alias) || path.extension() != ".lua") {
+                continue;
+            }
+
+            std::string file = path.string();
+            modules.emplace(name, file);
+            if (!alias.empty()) {
+                modules.emplace(alias, file);
+            }
+        }
+    }
+}
+
+bool LPM::Amalgamate::write(
+    const Packages& project,
+    const Modules::Index& index,
+    const std::string& bundle_path,
+    std::string& error,
+    bool use_bytecode
+) {
+    if (project.main.empty()) {
+        error = "Project " + project.name + " has no 'main' to bundle";
+
+        return false;
+    }
+
+    fs::path root = fs::absolute(project.path).lexically_normal().parent_path();
+    fs::path main_path = (root / project.main).lexically_normal();
+    fs::path modules_path = fs::absolute(index.path).lexically_normal().parent_path().parent_path();
+
+    if (!fs::is_regular_file(main_path)) {
+        error = "Main file " + main_path.string() + " does not exist";
+
+        return false;
+    }
+
+    // Project modules shadow installed ones, as ./?.lua comes first in
+    // the default package.path
+    std::map<std::string, std::string> modules;
+
+    try {
+        std::vector<fs::path> excluded {
+            main_path, fs::absolute(bundle_path).lexically_normal()
+        };
+
+        project_modules(root, modules_path, excluded, modules);
+    } catch (const fs::filesystem_error& e) {
+        error = "Failed to scan project " + root.string() + ": " + e.what();
+
+        return false;
+    }
+
+    for (auto& module : index.modules()) {
+        if (fs::path(module.second).extension() == ".lua") {
+            modules.emplace(module.first, module.second);
+        }
+    }
+
+    // One chunk per file, aliases share it
+    std::map<std::string, Chunk> chunks;
+    std::string main_file = main_path.string();
+
+    chunks[main_file].file = main_file;
+    for (auto& module : modules) {
+        chunks[module.second].file = module.second;
+    }
+
+    std::string payload;
+
+    for (auto& entry : chunks) {
+        Chunk& chunk = entry.second;
+        std::string source = chunk.file;
+
+        if (use_bytecode) {
+            auto compiled = index.bytecode.find(chunk.file);
+            if (compiled != index.bytecode.end() && compiled->second.contains("file")) {
+                source = compiled->second.at("file");
+            }
+        }
+
+        Utils::MappedFile file;
+        if (!file.open(source, error)) {
+            error = "Failed to read module " + source + ": " + error;
+
+            return false;
+        }
+
+        // Keep tracebacks pointing at the files the code came from
+        fs::path relative = fs::path(chunk.file).lexically_relative(root);
+        chunk.chunk_name = "@" + (relative.empty() ? chunk.file : relative.generic_string());
+        chunk.offset = payload.size();
+        chunk.size = file.size();
+
+        payload.append(file.data(), file.size());
+    }
+
+    // The payload goes in a long comment, whose closer must not show up
+    // inside it (bytecode can hold anything), nor start in its last bytes:
+    // a payload ending in "]=" would end "]=]" two bytes early. Level 0
+    // is never used, Lua 5.1 rejects a nested [[ in it.
+    auto closes_early = [&payload](const std::string& closer) {
+        if (payload.find(closer) != std::string::npos) {
+            return true;
+        }
+
+        size_t kept = std::min(payload.size(), closer.size() - 1);
+        std::string end = payload.substr(payload.size() - kept) + closer;
+
+        return end.find(closer) != kept;
+    };
+
+    std::string level = "=";
+    while (closes_early("]" + level + "]")) {
+        level += "=";
+    }
+
+    auto describe = [](const Chunk& chunk) {
+        return "{ " + std::to_string(chunk.offset) + ", " + std::to_string(chunk.size) + ", " +
+            Utils::quote_lua(chunk.chunk_name) + " }";
+    };
+
+    std::string bundle =
+        "-- Generated by lpm, do not edit\n"
+        "local base = " + std::string(BASE_PLACEHOLDER) + "\n"
+        "local main = " + describe(chunks[main_file]) + "\n"
+        "local modules = {\n";
+
+    for (auto& module : modules) {
+        bundle += "    [" + Utils::quote_lua(module.first) + "] = " + describe(chunks[module.second]) + ",\n";
+    }
+
+    bundle += "}\n";
+    bundle += BUNDLE_LOADER;
+    bundle += "--[" + level + "[\n";
+
+    size_t placeholder = bundle.find(BASE_PLACEHOLDER);
+    uint64_t base = bundle.size() - std::string(BASE_PLACEHOLDER).size() + BASE_WIDTH;
+
+    char digits[BASE_WIDTH + 1];
+    std::snprintf(digits, sizeof(digits), "%0*llu", BASE_WIDTH, static_cast<unsigned long long>(base));
+    bundle.replace(placeholder, std::string(BASE_PLACEHOLDER).size(), digits);
+
+    bundle += payload;
+    bundle += "]" + level + "]\n";
+
+    // Written next to the final path and renamed, so a running
+    // application never reads a half-written bundle
+    if (!Utils::replace_file(bundle_path, bundle)) {
+        error = "Failed to write bundle to " + bundle_path;
+
+        return false;
+    }
+
+    LPM_PRINT_DEBUG(
+        "Bundled " << project.main << " with " << modules.size() << " modules (" <<
+        payload.size() << " bytes) into " << bundle_path
+    );
+
+    return true;
+}
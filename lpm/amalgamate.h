@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include "manifests.h"
+#include "modules.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Amalgamate {
+    // Write a project and every installed module into a single Lua file,
+    // so starting the application opens one file instead of hundreds.
+    //
+    // The bundle holds the project's main, the Lua modules next to it and
+    // every Lua module of the index. Running it registers a package.preload
+    // loader for each of them and then runs main with the script arguments.
+    // Module code sits in a trailing long comment behind an index of
+    // offsets, and is only read and compiled on its first require.
+    //
+    // With use_bytecode, modules precompiled by Bytecode::compile are
+    // embedded as bytecode, which then only loads on that Lua version.
+    // Native modules can't be embedded and keep loading through
+    // package.cpath.
+    bool write(
+        const Packages& project,
+        const Modules::Index& index,
+        const std::string& bundle_path,
+        std::string& error,
+        bool use_bytecode = false
+    );
+}
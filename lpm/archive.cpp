@@ -0,0 +1,419 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <zip.h>
+#include "archive.h"
+#include "io.h"
+#include "macros.h"
+#include "scope_destructor.h"
+#include "stats.h"
+#include "utils.h"
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#if defined(__linux__)
+    #include <linux/fs.h>
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+#endif
+
+namespace {
+    const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+    const uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+    const uint32_t END_OF_DIRECTORY_SIGNATURE = 0x06054b50;
+
+    const size_t LOCAL_HEADER_SIZE = 30;
+    const size_t CENTRAL_HEADER_SIZE = 46;
+    const size_t END_OF_DIRECTORY_SIZE = 22;
+
+    uint16_t read_u16(const char* data) {
+        auto bytes = reinterpret_cast<const unsigned char*>(data);
+
+        return static_cast<uint16_t>(bytes[0] | bytes[1] << 8);
+    }
+
+    uint32_t read_u32(const char* data) {
+        return read_u16(data) | static_cast<uint32_t>(read_u16(data + 2)) << 16;
+    }
+
+    // Copy size bytes at offset of descriptor (also mapped at data) into
+    // a new file, letting the kernel move the data whenever it can
+    bool copy_stored(
+        int descriptor,
+        uint64_t offset,
+        const char* data,
+        uint64_t size,
+        const std::string& file_path,
+        std::string& error
+    ) {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+        int out = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (out < 0) {
+            error = "Failed to open file: " + file_path + " (" + std::strerror(errno) + ")";
+
+            return false;
+        }
+
+        uint64_t copied = 0;
+
+    #if defined(__linux__)
+        if (descriptor >= 0 && size > 0) {
+            // A reflink shares the blocks outright, but only works on
+            // block-aligned ranges of a filesystem that supports it
+            if (offset % 4096 == 0 && size % 4096 == 0) {
+                file_clone_range range {};
+                range.src_fd = descriptor;
+                range.src_offset = offset;
+                range.src_length = size;
+
+                if (ioctl(out, FICLONERANGE, &range) == 0) {
+                    copied = size;
+                }
+            }
+
+            // Explicit offsets leave the descriptor's own offset alone,
+            // so a shared descriptor can be copied from concurrently
+            loff_t in_offset = static_cast<loff_t>(offset);
+            while (copied < size) {
+                ssize_t result = copy_file_range(descriptor, &in_offset, out, nullptr, size - copied, 0);
+                if (result <= 0) {
+                    break;
+                }
+
+                copied += result;
+            }
+
+            off_t send_offset = static_cast<off_t>(offset + copied);
+            while (copied < size) {
+                ssize_t result = sendfile(out, descriptor, &send_offset, size - copied);
+                if (result <= 0) {
+                    break;
+                }
+
+                copied += result;
+            }
+
+            LPM::Stats::counters().zero_copy_bytes += copied;
+        }
+    #endif
+
+        // Anything the kernel couldn't copy is written from the mapping
+        while (copied < size) {
+            ssize_t result = ::write(out, data + copied, size - copied);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (result <= 0) {
+                error = "Failed to write to file: " + file_path + " (" + std::strerror(errno) + ")";
+                ::close(out);
+
+                return false;
+            }
+
+            copied += result;
+        }
+
+        if (::close(out) != 0) {
+            error = "Failed to write to file: " + file_path + " (" + std::strerror(errno) + ")";
+
+            return false;
+        }
+#else
+        std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open() || !file.write(data, size)) {
+            error = "Failed to write to file: " + file_path;
+
+            return false;
+        }
+#endif
+
+        LPM::Stats::counters().files_written++;
+        LPM::Stats::counters().bytes_written += size;
+
+        return true;
+    }
+
+    // For a libzip archive that may never get opened
+    void close_archive(zip** archive) {
+        if (*archive) {
+            zip_close(*archive);
+        }
+    }
+
+    // Open an archive held in memory with libzip, without copying it
+    zip* open_buffer(const char* data, size_t size, std::string& error) {
+        zip_error_t zip_error;
+        zip_error_init(&zip_error);
+
+        zip_source_t* source = zip_source_buffer_create(data, size, 0, &zip_error);
+        if (!source) {
+            error = "Can't read archive (libzip error code: " +
+                std::to_string(zip_error_code_zip(&zip_error)) + ")";
+            zip_error_fini(&zip_error);
+
+            return nullptr;
+        }
+
+        zip* archive = zip_open_from_source(source, ZIP_RDONLY, &zip_error);
+        if (!archive) {
+            error = "Can't open archive (libzip error code: " +
+                std::to_string(zip_error_code_zip(&zip_error)) + ")";
+            zip_source_free(source);
+        }
+
+        zip_error_fini(&zip_error);
+
+        return archive;
+    }
+}
+
+bool LPM::Archive::entries(
+    const char* data,
+    size_t size,
+    std::vector<Entry>& result,
+    std::string& error
+) {
+    if (size < END_OF_DIRECTORY_SIZE) {
+        error = "Archive is too small to be a zip file";
+
+        return false;
+    }
+
+    // The end of central directory record is followed by a comment of up
+    // to 64 KiB, look for it backwards
+    size_t end = size - END_OF_DIRECTORY_SIZE;
+    size_t lowest = end > 0xFFFF ? end - 0xFFFF : 0;
+
+    while (read_u32(data + end) != END_OF_DIRECTORY_SIGNATURE) {
+        if (end == lowest) {
+            error = "Archive has no end of central directory record";
+
+            return false;
+        }
+
+        end--;
+    }
+
+    const char* record = data + end;
+    uint16_t disk = read_u16(record + 4), directory_disk = read_u16(record + 6);
+    uint16_t count = read_u16(record + 10);
+    uint32_t directory_size = read_u32(record + 12), directory_offset = read_u32(record + 16);
+
+    if (
+        disk != 0 || directory_disk != 0 ||
+        count == 0xFFFF || directory_size == 0xFFFFFFFF || directory_offset == 0xFFFFFFFF
+    ) {
+        error = "Multi-disk and zip64 archives are not supported";
+
+        return false;
+    }
+
+    if (static_cast<uint64_t>(directory_offset) + directory_size > end) {
+        error = "Central directory is out of bounds";
+
+        return false;
+    }
+
+    result.clear();
+    result.reserve(count);
+
+    size_t position = directory_offset;
+    size_t directory_end = position + directory_size;
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (
+            position + CENTRAL_HEADER_SIZE > directory_end ||
+            read_u32(data + position) != CENTRAL_HEADER_SIGNATURE
+        ) {
+            error = "Corrupted central directory entry " + std::to_string(i);
+
+            return false;
+        }
+
+        const char* header = data + position;
+        Entry entry;
+        entry.flags = read_u16(header + 8);
+        entry.method = read_u16(header + 10);
+        entry.compressed_size = read_u32(header + 20);
+        entry.size = read_u32(header + 24);
+
+        uint16_t name_length = read_u16(header + 28);
+        uint16_t extra_length = read_u16(header + 30);
+        uint16_t comment_length = read_u16(header + 32);
+        uint64_t local_offset = read_u32(header + 42);
+
+        if (
+            entry.compressed_size == 0xFFFFFFFF || entry.size == 0xFFFFFFFF ||
+            local_offset == 0xFFFFFFFF
+        ) {
+            error = "Zip64 entries are not supported";
+
+            return false;
+        }
+
+        size_t next = position + CENTRAL_HEADER_SIZE + name_length + extra_length + comment_length;
+        if (next > directory_end) {
+            error = "Corrupted central directory entry " + std::to_string(i);
+
+            return false;
+        }
+
+        entry.name.assign(header + CENTRAL_HEADER_SIZE, name_length);
+
+        // The local header repeats the name but may carry a different
+        // extra field, the data starts after both
+        if (
+            local_offset + LOCAL_HEADER_SIZE > directory_offset ||
+            read_u32(data + local_offset) != LOCAL_HEADER_SIGNATURE
+        ) {
+            error = "Corrupted local header for " + entry.name;
+
+            return false;
+        }
+
+        const char* local = data + local_offset;
+        entry.data_offset = local_offset + LOCAL_HEADER_SIZE + read_u16(local + 26) + read_u16(local + 28);
+
+        if (entry.data_offset + entry.compressed_size > directory_offset) {
+            error = "Data of " + entry.name + " is out of bounds";
+
+            return false;
+        }
+
+        // Stored entries are copied size bytes straight from the archive,
+        // only compressed_size of which were checked above
+        if (entry.is_stored() && entry.size != entry.compressed_size) {
+            error = "Sizes of stored entry " + entry.name + " don't match";
+
+            return false;
+        }
+
+        result.push_back(std::move(entry));
+        position = next;
+    }
+
+    return true;
+}
+
+bool LPM::Archive::extract(
+    const std::string& archive_path,
+    const std::string& dest_path,
+    std::string& error
+) {
+    Utils::MappedFile file;
+    if (!file.open(archive_path, error)) {
+        return false;
+    }
+
+    return extract(file.data(), file.size(), file.descriptor(), 0, dest_path, error);
+}
+
+bool LPM::Archive::extract(
+    const char* data,
+    size_t size,
+    int descriptor,
+    std::uint64_t file_offset,
+    const std::string& dest_path,
+    std::string& error
+) {
+    std::vector<Entry> archive_entries;
+    std::string parse_error;
+
+    // Whatever we can't parse ourselves, libzip may still read
+    if (!entries(data, size, archive_entries, parse_error)) {
+        LPM_PRINT_DEBUG("Falling back to libzip: " << parse_error);
+
+        zip* archive = open_buffer(data, size, error);
+        if (!archive) {
+            return false;
+        }
+
+        scope_destructor<zip*, zip_close> archive_zip(archive);
+
+        return Utils::unzip(archive_zip.get(), dest_path, error);
+    }
+
+    // Only opened once a compressed entry shows up
+    zip* archive = nullptr;
+    scope_destructor<zip**, close_archive> archive_closer(&archive);
+
+    // Small files are queued and written together, large stored ones are
+    // copied by the kernel right away. Whatever happens, nothing pointing
+    // into data is left queued.
+    IO::Backend& io = IO::local();
+    scope_destructor<IO::Backend*, Utils::discard_batch> batch(&io);
+
+    for (size_t i = 0; i < archive_entries.size(); i++) {
+        const Entry& entry = archive_entries[i];
+
+        // Entry names come from the archive, never let one write outside
+        // of the destination
+        if (!Utils::safe_entry_name(entry.name)) {
+            error = "Refusing to extract entry '" + entry.name + "' outside of " + dest_path;
+
+            return false;
+        }
+
+        std::string file_path = dest_path + "/" + entry.name;
+
+        if (entry.is_directory()) {
+            io.directory(file_path);
+            continue;
+        }
+
+        if (entry.is_stored() && entry.size <= LPM_IO_SMALL_FILE) {
+            if (!io.write(file_path, data + entry.data_offset, entry.size, error)) {
+                return false;
+            }
+
+            continue;
+        }
+
+        if (entry.is_stored()) {
+            if (
+                !Utils::create_parent_directories(file_path) ||
+                !copy_stored(
+                    descriptor, file_offset + entry.data_offset,
+                    data + entry.data_offset, entry.size,
+                    file_path, error
+                )
+            ) {
+                if (error.empty()) {
+                    error = "Failed to create file at path: " + file_path;
+                }
+
+                return false;
+            }
+
+            continue;
+        }
+
+        if (!archive) {
+            archive = open_buffer(data, size, error);
+            if (!archive) {
+                return false;
+            }
+        }
+
+        // libzip lists entries in central directory order as well
+        std::string content;
+        if (
+            !Utils::read_entry(archive, i, content, error) ||
+            !io.write(file_path, std::move(content), error)
+        ) {
+            return false;
+        }
+    }
+
+    if (!io.flush(error)) {
+        return false;
+    }
+
+    LPM_PRINT_DEBUG("Extracted " << archive_entries.size() << " entries to " << dest_path);
+
+    return true;
+}
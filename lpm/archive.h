@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace LPM::Archive {
+    // One file of a zip archive, as listed by its central directory
+    struct Entry {
+        std::string name;
+        std::uint16_t method = 0, flags = 0;
+        std::uint64_t compressed_size = 0, size = 0;
+
+        // Offset of the entry's data from the start of the archive
+        std::uint64_t data_offset = 0;
+
+        bool is_directory() const { return !name.empty() && name.back() == '/'; }
+        bool is_stored() const { return method == 0 && !(flags & 1); }
+    };
+
+    // Parse the central directory of a zip archive held in memory. Only
+    // plain zip archives are understood, anything else (zip64, multi-disk,
+    // corrupted) is left to libzip.
+    bool entries(
+        const char* data,
+        size_t size,
+        std::vector<Entry>& result,
+        std::string& error
+    );
+
+    // Extract an archive file to dest_path. It is mapped and parsed in
+    // place, large stored entries are copied by the kernel (a reflink,
+    // then copy_file_range or sendfile) without going through our buffers,
+    // and compressed entries are inflated by libzip. Small files are
+    // written together through the thread's IO backend.
+    bool extract(
+        const std::string& archive_path,
+        const std::string& dest_path,
+        std::string& error
+    );
+
+    // Same, for an archive already mapped in memory. When descriptor is
+    // not -1, data is mapped from that file at file_offset and stored
+    // entries are copied from it.
+    bool extract(
+        const char* data,
+        size_t size,
+        int descriptor,
+        std::uint64_t file_offset,
+        const std::string& dest_path,
+        std::string& error
+    );
+}
@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include "build.h"
+#include "bytecode.h"
+#include "cache.h"
+#include "env.h"
+#include "macros.h"
+#include "utils.h"
+#include "toml11/toml.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+    // Flags from a package's module.toml, split on whitespace and quoted
+    // word by word, so they can't run anything through the shell
+    std::string quote_words(const std::string& flags) {
+        std::string result;
+        size_t start = flags.find_first_not_of(" \t\r\n");
+
+        while (start != std::string::npos) {
+            size_t end = flags.find_first_of(" \t\r\n", start);
+            std::string word = flags.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+            if (!result.empty()) {
+                result += ' ';
+            }
+
+            result += LPM::Utils::quote_shell(word);
+            start = end == std::string::npos ? end : flags.find_first_not_of(" \t\r\n", end);
+        }
+
+        return result;
+    }
+
+    struct Module {
+        std::string name, output;
+        std::vector<std::string> sources;
+
+        // Filled in while building
+        std::string key, cached, error;
+        std::vector<std::string> objects;
+        bool built = false;
+    };
+
+    // Run task(0)..task(count - 1) on up to `jobs` threads
+    void parallel(size_t count, unsigned int jobs, const std::function<void(size_t)>& task) {
+        std::atomic<size_t> next { 0 };
+        auto worker = [&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                task(i);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < std::min<size_t>(jobs, count); i++) {
+            workers.emplace_back(worker);
+        }
+
+        worker();
+        for (auto& thread : workers) {
+            thread.join();
+        }
+    }
+
+    // Module names double as paths inside the package, so only plain
+    // identifiers are allowed between the dots
+    bool valid_module_name(const std::string& name) {
+        if (name.empty() || name.front() == '.' || name.back() == '.') {
+            return false;
+        }
+
+        for (size_t i = 0; i < name.size(); i++) {
+            char c = name[i];
+            bool is_identifier = std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+
+            if (!is_identifier && !(c == '.' && name[i + 1] != '.')) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Hash a file's content into seed, a missing file changes nothing
+    uint64_t hash_file(const std::string& path, uint64_t seed) {
+        LPM::Utils::MappedFile file;
+        std::string error;
+
+        if (!file.open(path, error)) {
+            return seed;
+        }
+
+        return LPM::Utils::hash(file.data(), file.size(), seed);
+    }
+
+    uint64_t hash_string(const std::string& str, uint64_t seed) {
+        // Length first, so ("ab", "c") and ("a", "bc") hash differently
+        uint64_t size = str.size();
+        seed = LPM::Utils::hash(reinterpret_cast<const char*>(&size), sizeof(size), seed);
+
+        return LPM::Utils::hash(str.data(), str.size(), seed);
+    }
+
+    // Read the module list of a package, from its module.toml or by
+    // collecting every .c file
+    bool plan(
+        const fs::path& package_path,
+        std::vector<Module>& modules,
+        std::string& cflags,
+        std::string& ldflags,
+        std::string& error
+    ) {
+        fs::path manifest_path = package_path / LPM_MODULE_MANIFEST_NAME;
+        std::map<std::string, std::vector<std::string>> listed;
+
+        if (fs::exists(manifest_path)) {
+            try {
+                toml::value data = toml::parse(manifest_path.string());
+
+                if (data.contains("build")) {
+                    auto& build = toml::find(data, "build");
+
+                    cflags = toml::find_or<std::string>(build, "cflags", "");
+                    ldflags = toml::find_or<std::string>(build, "ldflags", "");
+
+                    if (build.contains("modules")) {
+                        listed = toml::find<
+                            std::map<std::string, std::vector<std::string>>
+                        >(build, "modules");
+                    }
+                }
+            } catch (const std::exception& e) {
+                error = "Failed to read " + manifest_path.string() + ": " + e.what();
+
+                return false;
+            }
+        }
+
+        if (listed.empty()) {
+            std::vector<std::string> sources;
+
+            for (auto& entry : fs::recursive_directory_iterator(package_path)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".c") {
+                    sources.push_back(fs::relative(entry.path(), package_path).generic_string());
+                }
+            }
+
+            if (sources.empty()) {
+                error = "Package " + package_path.string() + " has no C sources to build";
+
+                return false;
+            }
+
+            std::sort(sources.begin(), sources.end());
+            listed.emplace("init", std::move(sources));
+        }
+
+        for (auto& module : listed) {
+            if (!valid_module_name(module.first)) {
+                error = "Invalid native module name '" + module.first + "'";
+
+                return false;
+            }
+
+            if (module.second.empty()) {
+                error = "Native module '" + module.first + "' has no sources";
+
+                return false;
+            }
+
+            std::string relative = module.first;
+            std::replace(relative.begin(), relative.end(), '.', '/');
+
+            Module planned;
+            planned.name = module.first;
+            planned.output = (package_path / (relative + ".so")).string();
+
+            for (auto& source : module.second) {
+                fs::path normal = fs::path(source).lexically_normal();
+
+                if (normal.is_absolute() || normal.empty() || *normal.begin() == "..") {
+                    error = "Source '" + source + "' of native module '" + module.first +
+                        "' is outside of the package";
+
+                    return false;
+                }
+
+                planned.sources.push_back((package_path / normal).string());
+            }
+
+            modules.push_back(std::move(planned));
+        }
+
+        return true;
+    }
+}
+
+bool LPM::Build::toolchain(
+    const Config& config,
+    const std::string& lua_version,
+    Toolchain& result,
+    std::string& error
+) {
+#if defined(_WIN32)
+    error = "Building native modules is not supported on Windows yet";
+
+    return false;
+#else
+    result.compiler = Env::get("CC", "cc");
+    result.cflags = Env::get("CFLAGS", "-O2");
+    result.ldflags = Env::get("LDFLAGS", "");
+    result.lua_version = lua_version.empty() ? "default" : lua_version;
+    result.cache_path = config.packages_cache;
+
+    auto configured = config.lua_includes.find(result.lua_version);
+    if (configured == config.lua_includes.end()) {
+        configured = config.lua_includes.find("default");
+    }
+
+    if (configured != config.lua_includes.end()) {
+        result.lua_include = configured->second;
+    } else {
+        // /usr/bin/lua5.4 usually pairs with /usr/include/lua5.4, or
+        // plain /usr/include for a single installed version
+        std::string lua = Bytecode::interpreter(config, lua_version);
+        if (lua.empty()) {
+            error = "No Lua interpreter configured for version '" + result.lua_version + "'";
+
+            return false;
+        }
+
+        fs::path interpreter(lua);
+        fs::path prefix = interpreter.parent_path().parent_path() / "include";
+        std::string name = interpreter.filename().string();
+        std::string version = name.substr(std::min(name.size(), std::string("lua").size()));
+
+        for (auto& candidate : {
+            prefix / name,
+            prefix / ("lua" + version),
+            prefix / ("lua-" + version),
+            prefix
+        }) {
+            std::error_code fs_error;
+            if (fs::exists(candidate / "lua.h", fs_error)) {
+                result.lua_include = candidate.string();
+                break;
+            }
+        }
+    }
+
+    if (result.lua_include.empty()) {
+        error = "Can't find the headers of Lua '" + result.lua_version +
+            "', set them in the 'lua_includes' section of your lpm.toml";
+
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+bool LPM::Build::build(
+    const Toolchain& toolchain,
+    const std::string& package_path,
+    std::string& error
+) {
+    std::vector<Module> modules;
+    std::string package_cflags, package_ldflags;
+
+    std::vector<std::string> headers;
+
+    try {
+        if (!plan(package_path, modules, package_cflags, package_ldflags, error)) {
+            return false;
+        }
+
+        // Packages are untrusted, unlike CFLAGS and LDFLAGS from the
+        // environment which may rely on shell quoting
+        package_cflags = quote_words(package_cflags);
+        package_ldflags = quote_words(package_ldflags);
+
+        // Sources may include any header of the package
+        for (auto& entry : fs::recursive_directory_iterator(package_path)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".h") {
+                headers.push_back(entry.path().string());
+            }
+        }
+    } catch (const fs::filesystem_error& e) {
+        error = "Failed to scan package " + package_path + ": " + e.what();
+
+        return false;
+    }
+
+    std::sort(headers.begin(), headers.end());
+
+    // The compiler's own banner stands in for its identity, so switching
+    // compilers (or upgrading one) invalidates the cache
+    std::string identity;
+    if (Utils::run(Utils::quote_shell(toolchain.compiler) + " --version 2>/dev/null", identity) != 0) {
+        error = "Can't run the C compiler '" + toolchain.compiler + "'";
+
+        return false;
+    }
+
+    uint64_t common = Utils::hash("", 0);
+    for (const std::string* part : std::initializer_list<const std::string*> {
+        &identity, &toolchain.compiler, &toolchain.cflags, &toolchain.ldflags,
+        &toolchain.lua_version, &toolchain.lua_include, &package_cflags, &package_ldflags
+    }) {
+        common = hash_string(*part, common);
+    }
+
+    for (auto& header : headers) {
+        common = hash_string(fs::relative(header, package_path).generic_string(), common);
+        common = hash_file(header, common);
+    }
+
+    fs::path cache_path = fs::path(toolchain.cache_path) / LPM_BUILD_CACHE_NAME / toolchain.lua_version;
+    std::error_code fs_error;
+    fs::create_directories(cache_path, fs_error);
+    if (fs_error) {
+        error = "Failed to create build cache " + cache_path.string() + ": " + fs_error.message();
+
+        return false;
+    }
+
+    Cache::touch(toolchain.cache_path, cache_path.string());
+
+    // Objects of this build go in a private directory, so concurrent
+    // builds of the same package never step on each other
+    std::random_device random;
+    fs::path work_path = cache_path / (
+        "tmp-" + Utils::to_hex((static_cast<uint64_t>(random()) << 32) | random())
+    );
+
+    struct Object {
+        Module* module;
+        std::string source, object;
+    };
+
+    std::vector<Object> objects;
+
+    for (auto& module : modules) {
+        uint64_t key = hash_string(module.name, common);
+        for (auto& source : module.sources) {
+            key = hash_string(fs::relative(source, package_path).generic_string(), key);
+            key = hash_file(source, key);
+        }
+
+        module.key = Utils::to_hex(key);
+        module.cached = (cache_path / (module.key + ".so")).string();
+
+        if (fs::exists(module.cached, fs_error)) {
+            module.built = true;
+            continue;
+        }
+
+        for (auto& source : module.sources) {
+            std::string object = (work_path / (std::to_string(objects.size()) + ".o")).string();
+            module.objects.push_back(object);
+            objects.push_back(Object { &module, source, object });
+        }
+    }
+
+    unsigned int jobs = toolchain.jobs > 0
+        ? toolchain.jobs
+        : std::max(1u, std::thread::hardware_concurrency());
+
+    if (!objects.empty()) {
+        fs::create_directories(work_path, fs_error);
+        if (fs_error) {
+            error = "Failed to create build directory " + work_path.string() + ": " + fs_error.message();
+
+            return false;
+        }
+
+        std::vector<std::string> errors(objects.size());
+
+        // Compile every object of every module at once, then link
+        parallel(objects.size(), jobs, [&](size_t i) {
+            std::string command =
+                Utils::quote_shell(toolchain.compiler) + " " + toolchain.cflags + " " + package_cflags +
+                " -fPIC -I" + Utils::quote_shell(toolchain.lua_include) +
+                " -I" + Utils::quote_shell(package_path) +
+                " -c " + Utils::quote_shell(objects[i].source) +
+                " -o " + Utils::quote_shell(objects[i].object) + " 2>&1";
+
+            std::string output;
+            if (Utils::run(command, output) != 0) {
+                errors[i] = "Failed to compile " + objects[i].source + ":\n" + output;
+            }
+        });
+
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (!errors[i].empty() && objects[i].module->error.empty()) {
+                objects[i].module->error = errors[i];
+            }
+        }
+
+        parallel(modules.size(), jobs, [&](size_t i) {
+            Module& module = modules[i];
+            if (module.built || !module.error.empty()) {
+                return;
+            }
+
+            std::string temporary_path = (work_path / (module.key + ".so")).string();
+
+            std::string command = Utils::quote_shell(toolchain.compiler) + " " + toolchain.cflags;
+#if defined(__APPLE__)
+            command += " -bundle -undefined dynamic_lookup";
+#else
+            command += " -shared";
+#endif
+            command += " -o " + Utils::quote_shell(temporary_path);
+            for (auto& object : module.objects) {
+                command += " " + Utils::quote_shell(object);
+            }
+            command += " " + toolchain.ldflags + " " + package_ldflags + " 2>&1";
+
+            std::string output;
+            if (Utils::run(command, output) != 0) {
+                module.error = "Failed to link native module '" + module.name + "':\n" + output;
+
+                return;
+            }
+
+            std::error_code rename_error;
+            fs::rename(temporary_path, module.cached, rename_error);
+            if (rename_error) {
+                module.error = "Failed to store native module '" + module.name + "': " + rename_error.message();
+
+                return;
+            }
+
+            LPM_PRINT_DEBUG("Built native module " << module.name << " to " << module.cached);
+            module.built = true;
+        });
+
+        fs::remove_all(work_path, fs_error);
+    }
+
+    for (auto& module : modules) {
+        if (!module.built) {
+            error = module.error;
+
+            return false;
+        }
+
+        fs::create_directories(fs::path(module.output).parent_path(), fs_error);
+        fs::copy_file(module.cached, module.output, fs::copy_options::overwrite_existing, fs_error);
+        if (fs_error) {
+            error = "Failed to install native module " + module.output + ": " + fs_error.message();
+
+            return false;
+        }
+    }
+
+    LPM_PRINT_DEBUG(
+        "Built " << modules.size() << " native modules for " << package_path <<
+        " (" << objects.size() << " objects compiled)"
+    );
+
+    return true;
+}
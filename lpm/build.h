@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include "manifests.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Build {
+    // How native modules get compiled and linked
+    struct Toolchain {
+        // C compiler ($CC, or cc) and the flags passed to every
+        // compile ($CFLAGS, or -O2) and link ($LDFLAGS)
+        std::string compiler, cflags, ldflags;
+
+        // Lua version the modules are built for and the directory
+        // holding its lua.h
+        std::string lua_version, lua_include;
+
+        // Where built modules are cached, shared by every project
+        std::string cache_path;
+
+        // Parallel compiler processes, 0 means one per core
+        unsigned int jobs = 0;
+    };
+
+    // Resolve the toolchain for lua_version. The Lua headers come from
+    // the 'lua_includes' section of the config when present, otherwise
+    // they are looked up next to the configured interpreter.
+    bool toolchain(
+        const Config& config,
+        const std::string& lua_version,
+        Toolchain& result,
+        std::string& error
+    );
+
+    // Compile the native modules of an extracted `source` package in
+    // place. The package's module.toml can list them under 'build.modules':
+    //
+    //   [build]
+    //   cflags = "-DNDEBUG"
+    //   ldflags = "-lm"
+    //
+    //   [build.modules]
+    //   core = ["src/core.c", "src/buffer.c"]     # -> <package>/core.so
+    //
+    // Without it, every .c file in the package is linked into a single
+    // module loaded as the package itself (<package>/init.so).
+    //
+    // Each module is cached by a hash of its sources, the package headers,
+    // flags, compiler and Lua version, so unchanged modules are only ever
+    // built once.
+    bool build(
+        const Toolchain& toolchain,
+        const std::string& package_path,
+        std::string& error
+    );
+}
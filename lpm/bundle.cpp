@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <set>
+#include "bundle.h"
+#include "fetch.h"
+#include "macros.h"
+
+namespace {
+    const char BUNDLE_MAGIC[8] = { 'L', 'P', 'M', 'B', 'N', 'D', 'L', '\0' };
+    const size_t BUNDLE_HEADER_SIZE = 8 + 4 + 4 + 8;
+
+    // Three empty strings, an offset and a size
+    const size_t BUNDLE_MIN_RECORD_SIZE = 2 + 2 + 2 + 8 + 8;
+
+    void put_u16(std::string& out, uint16_t value) {
+        LPM::Utils::put_le(out, value, 2);
+    }
+
+    void put_u32(std::string& out, uint32_t value) {
+        LPM::Utils::put_le(out, value, 4);
+    }
+
+    void put_u64(std::string& out, uint64_t value) {
+        LPM::Utils::put_le(out, value, 8);
+    }
+
+    // Lengths are 16-bit, prefetch() refuses longer strings up front
+    void put_string(std::string& out, const std::string& value) {
+        put_u16(out, static_cast<uint16_t>(value.size()));
+        out += value;
+    }
+
+    // Reads little-endian integers and length-prefixed strings out of a
+    // buffer, failing instead of reading past its end
+    class Cursor {
+    public:
+        Cursor(const char* data, size_t size) : data(data), size(size) {}
+
+        bool read(uint64_t& value, int bytes) {
+            if (position + bytes > size) {
+                return false;
+            }
+
+            value = LPM::Utils::get_le(data + position, bytes);
+            position += bytes;
+            return true;
+        }
+
+        bool read(std::string& value) {
+            uint64_t length = 0;
+            if (!read(length, 2) || position + length > size) {
+                return false;
+            }
+
+            value.assign(data + position, length);
+            position += length;
+            return true;
+        }
+    private:
+        const char* data;
+        size_t size;
+        size_t position = 0;
+    };
+}
+
+const LPM::Bundle::Entry* LPM::Bundle::Reader::find(
+    const std::string& name,
+    const std::string& version
+) const {
+    for (auto& entry : entries) {
+        if (entry.name == name && entry.version == version) {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+void LPM::Bundle::Reader::load() {
+    std::string error;
+    if (!file.open(this->path, error)) {
+        throw std::runtime_error("Failed to open bundle: " + error);
+    }
+
+    if (
+        file.size() < BUNDLE_HEADER_SIZE ||
+        std::memcmp(file.data(), BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0
+    ) {
+        throw std::runtime_error("Not an lpm bundle: " + this->path);
+    }
+
+    Cursor header(file.data() + 8, BUNDLE_HEADER_SIZE - 8);
+    uint64_t format_version = 0, entry_count = 0, index_size = 0;
+    header.read(format_version, 4);
+    header.read(entry_count, 4);
+    header.read(index_size, 8);
+
+    if (format_version != LPM_BUNDLE_FORMAT_VERSION) {
+        throw std::runtime_error(
+            "Unsupported bundle format version " + std::to_string(format_version) +
+            " in " + this->path
+        );
+    }
+
+    if (index_size > file.size() - BUNDLE_HEADER_SIZE) {
+        throw std::runtime_error("Truncated bundle index in " + this->path);
+    }
+
+    // The count comes from the file, an index record takes at least
+    // BUNDLE_MIN_RECORD_SIZE bytes of it
+    Cursor index(file.data() + BUNDLE_HEADER_SIZE, index_size);
+    this->entries.clear();
+    this->entries.reserve(std::min<uint64_t>(entry_count, index_size / BUNDLE_MIN_RECORD_SIZE));
+
+    for (uint64_t i = 0; i < entry_count; i++) {
+        Entry entry;
+
+        if (
+            !index.read(entry.name) ||
+            !index.read(entry.version) ||
+            !index.read(entry.package_type) ||
+            !index.read(entry.offset, 8) ||
+            !index.read(entry.size, 8) ||
+            entry.offset > file.size() ||
+            entry.size > file.size() - entry.offset
+        ) {
+            throw std::runtime_error(
+                "Corrupted bundle index entry " + std::to_string(i) + " in " + this->path
+            );
+        }
+
+        this->entries.push_back(std::move(entry));
+    }
+
+    LPM_PRINT_DEBUG("Loaded bundle " << this->path << " with " << this->entries.size() << " archives");
+}
+
+bool LPM::Bundle::prefetch(
+    const std::vector<std::string>& manifest_paths,
+    std::vector<Repository>& repositories,
+    const std::string& bundle_path,
+    std::string& error
+) {
+    std::vector<Entry> entries;
+    std::vector<std::string> urls;
+    std::set<std::pair<std::string, std::string>> seen;
+
+    // Resolve every dependency of every manifest, only once
+    for (auto& manifest_path : manifest_paths) {
+        try {
+            Packages manifest(manifest_path);
+
+            for (auto& dependency : manifest.dependencies) {
+                if (!seen.insert(dependency).second) {
+                    continue;
+                }
+
+                const Repository::Package* package = nullptr;
+                for (auto& repository : repositories) {
+                    auto found = repository.packages.find(dependency.first);
+                    if (found != repository.packages.end()) {
+                        package = &found->second;
+                        break;
+                    }
+                }
+
+                if (!package) {
+                    error = "Package '" + dependency.first + "' required by " + manifest_path +
+                        " was not found in any repository";
+
+                    return false;
+                }
+
+                auto url = package->versions.find(dependency.second);
+                if (url == package->versions.end()) {
+                    error = "Package '" + dependency.first + "' has no version '" +
+                        dependency.second + "'";
+
+                    return false;
+                }
+
+                entries.push_back(Entry {
+                    dependency.first, dependency.second, package->package_type, 0, 0
+                });
+                urls.push_back(url->second);
+            }
+        } catch (const std::exception& e) {
+            error = "Failed to read manifest '" + manifest_path + "': " + e.what();
+
+            return false;
+        }
+    }
+
+    // The index size is known up front, so archives can go to the file
+    // as they arrive and the header and index be written last
+    uint64_t index_size = 0;
+    for (auto& entry : entries) {
+        if (std::max({ entry.name.size(), entry.version.size(), entry.package_type.size() }) > UINT16_MAX) {
+            error = "Package '" + entry.name.substr(0, 64) + "' has a name, version or type longer than " +
+                std::to_string(UINT16_MAX) + " bytes, which a bundle can't hold";
+
+            return false;
+        }
+
+        index_size += 2 + entry.name.size() + 2 + entry.version.size() +
+            2 + entry.package_type.size() + 8 + 8;
+    }
+
+    // Write to a temporary file first so a reader never sees a partial bundle
+    std::string temporary_path = Utils::temporary_path(bundle_path);
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        error = "Failed to open bundle file for writing: " + temporary_path;
+
+        return false;
+    }
+
+    std::vector<Fetch::Request> requests;
+    requests.reserve(urls.size());
+    for (auto& url : urls) {
+        requests.push_back(Fetch::Request { url, {} });
+    }
+
+    // Download every archive at once, as fast as each host lets us, and
+    // append each one (in whatever order they come) as soon as it is
+    // there, so only the downloads in flight are held in memory
+    uint64_t written = BUNDLE_HEADER_SIZE + index_size;
+    bool failed = false;
+
+    Fetch::get_each(requests, [&](size_t i, Requests::Response& response) {
+        if (failed) {
+            return;
+        }
+
+        if (response.status_code != 200) {
+            error = "Failed to download package from url '" + urls[i] + "': " +
+                std::to_string(response.status_code);
+            failed = true;
+
+            return;
+        }
+
+        entries[i].offset =
+            (written + LPM_BUNDLE_ALIGNMENT - 1) / LPM_BUNDLE_ALIGNMENT * LPM_BUNDLE_ALIGNMENT;
+        entries[i].size = response.body.size();
+
+        file.seekp(entries[i].offset);
+        file.write(response.body.data(), response.body.size());
+        written = entries[i].offset + entries[i].size;
+
+        if (!file.good()) {
+            error = "Failed to write bundle file: " + temporary_path;
+            failed = true;
+
+            return;
+        }
+
+        LPM_PRINT_DEBUG("Prefetched " << entries[i].name << ":" << entries[i].version);
+    });
+
+    std::error_code remove_error;
+    if (failed) {
+        file.close();
+        std::filesystem::remove(temporary_path, remove_error);
+
+        return false;
+    }
+
+    std::string head(BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    put_u32(head, LPM_BUNDLE_FORMAT_VERSION);
+    put_u32(head, static_cast<uint32_t>(entries.size()));
+    put_u64(head, index_size);
+
+    for (auto& entry : entries) {
+        put_string(head, entry.name);
+        put_string(head, entry.version);
+        put_string(head, entry.package_type);
+        put_u64(head, entry.offset);
+        put_u64(head, entry.size);
+    }
+
+    file.seekp(0);
+    file.write(head.data(), head.size());
+    file.close();
+
+    if (!file) {
+        error = "Failed to write bundle file: " + temporary_path;
+        std::filesystem::remove(temporary_path, remove_error);
+
+        return false;
+    }
+
+    std::error_code rename_error;
+    std::filesystem::rename(temporary_path, bundle_path, rename_error);
+    if (rename_error) {
+        error = "Failed to move bundle into place at " + bundle_path + ": " + rename_error.message();
+        std::filesystem::remove(temporary_path, remove_error);
+
+        return false;
+    }
+
+    LPM_PRINT_DEBUG("Wrote bundle " << bundle_path << " with " << entries.size() << " archives");
+
+    return true;
+}
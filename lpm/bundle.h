@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "manifests.h"
+#include "utils.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Bundle {
+    // A prefetch bundle is a single file that carries every archive needed
+    // to install one or more projects offline. Its layout is:
+    //
+    //   header   magic, format version, entry count, index size
+    //   index    one record per archive (name, version, type, offset, size)
+    //   archives each one aligned to LPM_BUNDLE_ALIGNMENT so they can be
+    //            read straight out of the mapping
+    //
+    // All integers are stored little-endian.
+    struct Entry {
+        std::string name, version, package_type;
+        uint64_t offset, size;
+    };
+
+    class Reader {
+    public:
+        Reader(const std::string& path) {
+            this->path = path;
+            this->load();
+        }
+
+        std::string path;
+        std::vector<Entry> entries;
+
+        // Returns nullptr if the bundle does not carry the archive
+        const Entry* find(const std::string& name, const std::string& version) const;
+
+        const char* data(const Entry& entry) const { return file.data() + entry.offset; }
+        int descriptor() const { return file.descriptor(); }
+
+        void load();
+    private:
+        Utils::MappedFile file;
+    };
+
+    // Resolve the dependencies of every manifest against the repositories
+    // (first repository that has a package wins), download each archive
+    // once and write them all to a bundle at bundle_path. Archives go to
+    // the file as they arrive, none is kept in memory past its download.
+    bool prefetch(
+        const std::vector<std::string>& manifest_paths,
+        std::vector<Repository>& repositories,
+        const std::string& bundle_path,
+        std::string& error
+    );
+}
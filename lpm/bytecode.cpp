@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <set>
+#include <thread>
+#include <vector>
+#include "bytecode.h"
+#include "cache.h"
+#include "macros.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    // Run by the target interpreter itself, so the bytecode always
+    // matches the VM that will load it
+    const char* COMPILE_SCRIPT = R"lua(-- Generated by lpm, do not edit
+local chunk = assert(loadfile(arg[1]))
+local out = assert(io.open(arg[2], "wb"))
+assert(out:write(string.dump(chunk)))
+assert(out:close())
+)lua";
+
+    struct Job {
+        std::string source, hash, bytecode, error;
+        bool compiled = false;
+    };
+
+    // Two interpreters configured under the same name (or an upgraded
+    // one) don't share bytecode: key the cache by the command, what it
+    // reports as its version and, when it is a path, the binary itself
+    std::string identity(const std::string& lua) {
+        std::string output;
+        LPM::Utils::run(LPM::Utils::quote_shell(lua) + " -v 2>&1", output);
+
+        std::string identity = lua + "\n" + output;
+
+        std::error_code fs_error;
+        fs::path binary = fs::canonical(lua, fs_error);
+        if (!fs_error) {
+            auto size = fs::file_size(binary, fs_error);
+            auto time = fs::last_write_time(binary, fs_error);
+            if (!fs_error) {
+                identity += binary.string() + "\n" + std::to_string(size) + "\n" +
+                    std::to_string(time.time_since_epoch().count());
+            }
+        }
+
+        return LPM::Utils::to_hex(LPM::Utils::hash(identity.data(), identity.size()));
+    }
+}
+
+std::string LPM::Bytecode::interpreter(
+    const Config& config,
+    const std::string& lua_version
+) {
+    auto found = config.luas.find(lua_version);
+    if (lua_version.empty() || found == config.luas.end()) {
+        found = config.luas.find("default");
+    }
+
+    return found != config.luas.end() ? found->second : "";
+}
+
+bool LPM::Bytecode::compile(
+    const Config& config,
+    const std::string& lua_version,
+    Modules::Index& index,
+    std::string& error,
+    unsigned int jobs
+) {
+    std::string lua = interpreter(config, lua_version);
+    if (lua.empty()) {
+        error = "No Lua interpreter configured for version '" + lua_version + "'";
+
+        return false;
+    }
+
+    std::string version = lua_version.empty() ? "default" : lua_version;
+    fs::path cache_path =
+        fs::path(config.packages_cache) / LPM_BYTECODE_CACHE_NAME / version / identity(lua);
+    fs::path script_path = cache_path / "compile.lua";
+
+    // Another lpm may be running the script right now: only write it
+    // when it isn't there yet, and then in one piece
+    std::error_code script_error;
+    if (!fs::exists(script_path, script_error) && !Utils::replace_file(script_path.string(), COMPILE_SCRIPT)) {
+        error = "Failed to write compile script to " + script_path.string();
+
+        return false;
+    }
+
+    // Cache hits below don't write anything, keep the collector informed
+    Cache::touch(config.packages_cache, cache_path.string());
+
+    // Aliases (foo and foo.init) share a file, compile it only once
+    std::set<std::string> sources;
+    for (auto& module : index.modules()) {
+        if (fs::path(module.second).extension() == ".lua") {
+            sources.insert(module.second);
+        }
+    }
+
+    std::vector<Job> queue;
+    queue.reserve(sources.size());
+    for (auto& source : sources) {
+        Job job;
+        job.source = source;
+        queue.push_back(job);
+    }
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]() {
+        for (size_t i = next++; i < queue.size(); i = next++) {
+            Job& job = queue[i];
+
+            Utils::MappedFile file;
+            if (!file.open(job.source, job.error)) {
+                continue;
+            }
+
+            // The chunk name (and so the path in tracebacks) is baked into
+            // the bytecode, so the path is part of the cache key as well
+            uint64_t hash = Utils::hash(file.data(), file.size());
+            job.hash = Utils::to_hex(hash);
+            job.bytecode = (
+                cache_path /
+                (Utils::to_hex(Utils::hash(job.source.data(), job.source.size(), hash)) + ".luac")
+            ).string();
+
+            // Never let a filesystem exception escape a worker thread
+            std::error_code fs_error;
+
+            if (fs::exists(job.bytecode, fs_error)) {
+                job.compiled = true;
+
+                continue;
+            }
+
+            // Compile next to the final path and rename, so concurrent
+            // installs never pick up a half-written file
+            std::string temporary_path = Utils::temporary_path(job.bytecode);
+
+            std::string command =
+                Utils::quote_shell(lua) + " " + Utils::quote_shell(script_path.string()) + " " +
+                Utils::quote_shell(job.source) + " " + Utils::quote_shell(temporary_path);
+
+            if (std::system(command.c_str()) != 0) {
+                job.error = "Failed to compile " + job.source;
+                fs::remove(temporary_path, fs_error);
+
+                continue;
+            }
+
+            fs::rename(temporary_path, job.bytecode, fs_error);
+            if (fs_error) {
+                job.error = "Failed to store bytecode for " + job.source + ": " + fs_error.message();
+
+                continue;
+            }
+
+            LPM_PRINT_DEBUG("Compiled " << job.source << " to " << job.bytecode);
+            job.compiled = true;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < std::min<size_t>(jobs, queue.size()); i++) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    size_t failed = 0;
+    for (auto& job : queue) {
+        if (job.compiled) {
+            index.bytecode[job.source] = {
+                { "hash", job.hash },
+                { "file", job.bytecode }
+            };
+        } else {
+            index.bytecode.erase(job.source);
+
+            if (failed++ == 0) {
+                error = job.error;
+            }
+        }
+    }
+
+    LPM_PRINT_DEBUG(
+        "Precompiled " << queue.size() - failed << " of " << queue.size() <<
+        " modules for Lua " << version
+    );
+
+    if (failed > 1) {
+        error += " (and " + std::to_string(failed - 1) + " more)";
+    }
+
+    return failed == 0;
+}
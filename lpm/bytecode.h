@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include "manifests.h"
+#include "modules.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Bytecode {
+    // Pick the interpreter configured for lua_version, falling back
+    // to the 'default' one. Returns an empty string if there is none.
+    std::string interpreter(const Config& config, const std::string& lua_version);
+
+    // Precompile every Lua module in the index to bytecode with the
+    // interpreter configured for lua_version, using up to `jobs` parallel
+    // compilers (0 means one per core).
+    //
+    // Results are cached in packages_cache by (source hash, interpreter),
+    // so unchanged sources are never compiled twice. The index is updated
+    // (but not saved) with the bytecode of every module that compiled;
+    // modules that failed are listed in error and keep loading from source.
+    bool compile(
+        const Config& config,
+        const std::string& lua_version,
+        Modules::Index& index,
+        std::string& error,
+        unsigned int jobs = 0
+    );
+}
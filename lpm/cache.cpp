@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "cache.h"
+#include "catalog.h"
+#include "macros.h"
+#include "modules.h"
+#include "utils.h"
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/file.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct Entry {
+        fs::path root, path;
+        fs::file_time_type last_access;
+        std::uint64_t size;
+    };
+
+    // The top-level entry of root holding path, or an empty path
+    fs::path entry_of(const fs::path& root, const fs::path& path) {
+        std::error_code error;
+        fs::path relative = fs::absolute(path, error).lexically_normal().lexically_relative(root);
+
+        if (error || relative.empty() || *relative.begin() == ".." || *relative.begin() == ".") {
+            return {};
+        }
+
+        std::string name = relative.begin()->string();
+        if (name.empty() || name[0] == '.') {
+            return {};
+        }
+
+        return root / name;
+    }
+
+    fs::path normalized_root(const std::string& root) {
+        fs::path result = fs::absolute(root).lexically_normal();
+        if (!result.has_filename()) {
+            result = result.parent_path();
+        }
+
+        return result;
+    }
+
+    fs::path marker_of(const fs::path& root, const fs::path& entry) {
+        std::string name = entry.filename().string();
+
+        return root / LPM_CACHE_ACCESS_DIR / LPM::Utils::to_hex(LPM::Utils::hash(name.data(), name.size()));
+    }
+
+    std::uint64_t size_of(const fs::path& path) {
+        std::error_code error;
+
+        if (!fs::is_directory(path, error)) {
+            std::uint64_t size = fs::file_size(path, error);
+            return error ? 0 : size;
+        }
+
+        std::uint64_t size = 0;
+        for (
+            auto it = fs::recursive_directory_iterator(
+                path, fs::directory_options::skip_permission_denied, error
+            );
+            !error && it != fs::recursive_directory_iterator();
+            it.increment(error)
+        ) {
+            if (it->is_regular_file(error)) {
+                size += it->file_size(error);
+            }
+        }
+
+        return size;
+    }
+
+    // Holds an exclusive, non-blocking lock so collectors never overlap
+    class CollectorLock {
+    public:
+        CollectorLock(const fs::path& path) {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+            descriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            acquired = descriptor >= 0 && flock(descriptor, LOCK_EX | LOCK_NB) == 0;
+#else
+            acquired = true;
+#endif
+        }
+
+        ~CollectorLock() {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+            if (descriptor >= 0) {
+                ::close(descriptor);
+            }
+#endif
+        }
+
+        bool acquired = false;
+    private:
+        int descriptor = -1;
+    };
+
+    bool evict(const Entry& entry, std::string& error) {
+        static std::atomic<unsigned> counter { 0 };
+
+        fs::path trash = entry.root / LPM_CACHE_TRASH_DIR;
+        fs::path target = trash / (
+            entry.path.filename().string() + "." +
+            std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "." +
+            std::to_string(counter++)
+        );
+
+        std::error_code fs_error;
+        fs::create_directories(trash, fs_error);
+        fs::rename(entry.path, target, fs_error);
+
+        if (fs_error) {
+            error = "Failed to evict " + entry.path.string() + ": " + fs_error.message();
+
+            return false;
+        }
+
+        fs::remove(marker_of(entry.root, entry.path), fs_error);
+        fs::remove_all(target, fs_error);
+
+        LPM_PRINT_DEBUG("Evicted " << entry.path << " (" << entry.size << " bytes)");
+
+        return true;
+    }
+}
+
+void LPM::Cache::touch(const std::string& cache_root, const std::string& path) {
+    fs::path root = normalized_root(cache_root);
+    fs::path entry = entry_of(root, path);
+
+    if (entry.empty()) {
+        return;
+    }
+
+    fs::path marker = marker_of(root, entry);
+    std::error_code error;
+
+    if (!fs::exists(marker, error)) {
+        fs::create_directories(marker.parent_path(), error);
+        std::ofstream(marker).close();
+    }
+
+    fs::last_write_time(marker, fs::file_time_type::clock::now(), error);
+    if (error) {
+        LPM_PRINT_DEBUG("Failed to record access to " << entry << ": " << error.message());
+    }
+}
+
+std::string LPM::Cache::archive_path(
+    const Config& config,
+    const std::string& name,
+    const std::string& version
+) {
+    return (fs::path(config.packages_cache) / (name + "-" + version + ".zip")).string();
+}
+
+bool LPM::Cache::references(
+    const Config& config,
+    const std::vector<std::string>& projects,
+    std::set<std::string>& keep,
+    std::string& error
+) {
+    for (auto& source : config.repositories) {
+        keep.insert(Catalog::Catalog::repository_path(config, source.first));
+    }
+
+    for (auto& project : projects) {
+        try {
+            Packages packages(project);
+
+            for (auto& dependency : packages.dependencies) {
+                keep.insert(archive_path(config, dependency.first, dependency.second));
+            }
+
+            // The index is relative to the project, not to where we run
+            fs::path index_path = fs::path(project).parent_path() / LPM_DEFAULT_LOCAL_MODULES_INDEX;
+            if (!fs::exists(index_path)) {
+                continue;
+            }
+
+            Modules::Index index(index_path.string());
+            for (auto& compiled : index.bytecode) {
+                auto file = compiled.second.find("file");
+                if (file != compiled.second.end()) {
+                    keep.insert(file->second);
+                }
+            }
+        } catch (const std::exception& e) {
+            error = "Failed to read project " + project + ": " + e.what();
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool LPM::Cache::collect(
+    const Config& config,
+    const std::vector<std::string>& projects,
+    Report& report,
+    std::string& error,
+    size_t max_evictions
+) {
+    report = Report {};
+
+    // A project we can't read might reference anything, evicting
+    // without knowing would cold-start it
+    std::set<std::string> keep;
+    if (!references(config, projects, keep, error)) {
+        return false;
+    }
+
+    std::vector<fs::path> roots = { normalized_root(config.packages_cache) };
+    fs::path repositories_root = normalized_root(config.repositories_cache);
+    if (repositories_root != roots[0]) {
+        roots.push_back(repositories_root);
+    }
+
+    std::error_code fs_error;
+    fs::create_directories(roots[0], fs_error);
+
+    CollectorLock lock(roots[0] / LPM_CACHE_LOCK_NAME);
+    if (!lock.acquired) {
+        LPM_PRINT_DEBUG("Another cache collector is running, skipping");
+
+        return true;
+    }
+
+    std::set<fs::path> kept;
+    for (auto& root : roots) {
+        // Leftovers of a collector that was interrupted mid-eviction
+        fs::remove_all(root / LPM_CACHE_TRASH_DIR, fs_error);
+
+        for (auto& path : keep) {
+            fs::path entry = entry_of(root, path);
+            if (!entry.empty()) {
+                kept.insert(entry);
+            }
+        }
+    }
+
+    auto now = fs::file_time_type::clock::now();
+    auto grace = std::chrono::seconds(LPM_CACHE_GRACE_SECONDS);
+    std::vector<Entry> candidates;
+    std::uint64_t total = 0;
+
+    for (auto& root : roots) {
+        if (!fs::is_directory(root, fs_error)) {
+            continue;
+        }
+
+        for (auto& child : fs::directory_iterator(root, fs_error)) {
+            fs::path path = child.path();
+            std::string name = path.filename().string();
+
+            if (name.empty() || name[0] == '.') {
+                continue;
+            }
+
+            Entry entry { root, path, fs::last_write_time(path, fs_error), size_of(path) };
+
+            std::error_code marker_error;
+            auto accessed = fs::last_write_time(marker_of(root, path), marker_error);
+            if (!marker_error && accessed > entry.last_access) {
+                entry.last_access = accessed;
+            }
+
+            report.scanned++;
+            total += entry.size;
+
+            if (!kept.contains(path) && now - entry.last_access > grace) {
+                candidates.push_back(std::move(entry));
+            }
+        }
+    }
+
+    // Oldest first, both passes evict from the front
+    std::sort(candidates.begin(), candidates.end(), [](const Entry& a, const Entry& b) {
+        return a.last_access < b.last_access;
+    });
+
+    std::uint64_t max_size = static_cast<std::uint64_t>(config.cache_max_size_mb) * 1024 * 1024;
+    auto max_age = std::chrono::hours(24 * config.cache_max_age_days);
+
+    for (auto& entry : candidates) {
+        if (report.evicted >= max_evictions) {
+            break;
+        }
+
+        bool expired = config.cache_max_age_days > 0 && now - entry.last_access > max_age;
+        bool over_budget = config.cache_max_size_mb > 0 && total > max_size;
+
+        // Candidates are sorted, once one is neither expired nor needed
+        // to get under budget, none of the following ones are either
+        if (!expired && !over_budget) {
+            break;
+        }
+
+        if (!evict(entry, error)) {
+            return false;
+        }
+
+        report.evicted++;
+        report.freed_bytes += entry.size;
+        total -= entry.size;
+    }
+
+    report.remaining_bytes = total;
+
+    LPM_PRINT_DEBUG(
+        "Cache collection: scanned " << report.scanned << " entries, evicted " <<
+        report.evicted << " (" << report.freed_bytes << " bytes), " <<
+        report.remaining_bytes << " bytes remaining"
+    );
+
+    return true;
+}
+
+std::future<bool> LPM::Cache::collect_async(
+    const Config& config,
+    std::vector<std::string> projects,
+    Report& report,
+    std::string& error,
+    size_t max_evictions
+) {
+    return std::async(
+        std::launch::async,
+        [config, projects = std::move(projects), &report, &error, max_evictions]() {
+            return collect(config, projects, report, error, max_evictions);
+        }
+    );
+}
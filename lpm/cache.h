@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <set>
+#include <string>
+#include <vector>
+#include "manifests.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Cache {
+    // Every direct child of packages_cache and repositories_cache (an
+    // archive, an extracted tree, the bytecode cache...) is one entry.
+    // Its last access is the time of a marker in <root>/.access, or its
+    // own modification time if it was never touched.
+    //
+    // Nothing here blocks an install: entries used within the last
+    // LPM_CACHE_GRACE_SECONDS are never evicted, and evicted entries are
+    // first renamed into <root>/.trash, so open files stay readable.
+
+    struct Report {
+        size_t scanned = 0, evicted = 0;
+        std::uint64_t freed_bytes = 0, remaining_bytes = 0;
+    };
+
+    // Record that the cache entry holding path was just used. Paths
+    // outside of cache_root are ignored.
+    void touch(const std::string& cache_root, const std::string& path);
+
+    // Where the archive of a package version is cached:
+    // <packages_cache>/<name>-<version>.zip
+    std::string archive_path(
+        const Config& config,
+        const std::string& name,
+        const std::string& version
+    );
+
+    // Every cache path the installed projects still use, given the
+    // packages.toml of each: the archive of every dependency, whatever
+    // the project's module index points into the cache (bytecode), and
+    // the repository file of every configured source.
+    bool references(
+        const Config& config,
+        const std::vector<std::string>& projects,
+        std::set<std::string>& keep,
+        std::string& error
+    );
+
+    // Evict unreferenced entries older than cache_max_age_days, then the
+    // least recently used ones until both caches fit cache_max_size_mb.
+    // Whatever references() finds for projects is never evicted. At most
+    // max_evictions entries go per call, so it can run incrementally.
+    //
+    // Only one collector runs at a time, if another one holds the lock
+    // this returns true without doing anything.
+    bool collect(
+        const Config& config,
+        const std::vector<std::string>& projects,
+        Report& report,
+        std::string& error,
+        size_t max_evictions = SIZE_MAX
+    );
+
+    // Run collect() on a background thread, report and error must
+    // outlive the returned future
+    std::future<bool> collect_async(
+        const Config& config,
+        std::vector<std::string> projects,
+        Report& report,
+        std::string& error,
+        size_t max_evictions = SIZE_MAX
+    );
+}
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include "catalog.h"
+#include "macros.h"
+#include "utils.h"
+
+std::string_view LPM::Catalog::StringArena::intern(std::string_view str) {
+    auto found = this->strings.find(str);
+    if (found != this->strings.end()) {
+        return *found;
+    }
+
+    std::string_view interned = store(str);
+    this->strings.insert(interned);
+
+    return interned;
+}
+
+std::string_view LPM::Catalog::StringArena::store(std::string_view str) {
+    if (str.empty()) {
+        return {};
+    }
+
+    if (this->used + str.size() > this->capacity) {
+        // Oversized strings get a block of their own
+        this->capacity = std::max<size_t>(LPM_CATALOG_ARENA_BLOCK_SIZE, str.size());
+        this->blocks.emplace_back(new char[this->capacity]);
+        this->allocated += this->capacity;
+        this->used = 0;
+    }
+
+    char* copy = this->blocks.back().get() + this->used;
+    std::memcpy(copy, str.data(), str.size());
+    this->used += str.size();
+
+    return std::string_view(copy, str.size());
+}
+
+LPM::Catalog::Catalog::Catalog(const Config& config) {
+    for (auto& source_name : order(config)) {
+        Repository repository(repository_path(config, source_name));
+        add(repository, source_name);
+    }
+
+    LPM_PRINT_DEBUG(
+        "Loaded catalog with " << this->packages.size() << " packages, " <<
+        this->versions.size() << " versions and " <<
+        this->strings.size() << " distinct strings (" << this->strings.bytes() << " bytes)"
+    );
+}
+
+std::vector<std::string> LPM::Catalog::Catalog::order(const Config& config) {
+    std::vector<std::pair<long, std::string>> sources;
+
+    for (auto& source : config.repositories) {
+        long priority = 0;
+
+        auto found = source.second.find("priority");
+        if (found != source.second.end()) {
+            const std::string& value = found->second;
+            auto result = std::from_chars(value.data(), value.data() + value.size(), priority);
+
+            if (result.ec != std::errc() || result.ptr != value.data() + value.size()) {
+                throw std::runtime_error(
+                    "Invalid priority '" + value + "' for source '" + source.first + "'"
+                );
+            }
+        }
+
+        sources.emplace_back(priority, source.first);
+    }
+
+    std::sort(sources.begin(), sources.end());
+
+    std::vector<std::string> names;
+    names.reserve(sources.size());
+    for (auto& source : sources) {
+        names.push_back(source.second);
+    }
+
+    return names;
+}
+
+std::string LPM::Catalog::Catalog::repository_path(
+    const Config& config,
+    const std::string& source_name
+) {
+    auto source = config.repositories.find(source_name);
+    if (source != config.repositories.end()) {
+        auto path = source->second.find("path");
+        if (path != source->second.end()) {
+            return path->second;
+        }
+    }
+
+    return (std::filesystem::path(config.repositories_cache) / (source_name + ".toml")).string();
+}
+
+size_t LPM::Catalog::Catalog::probe(std::string_view name) const {
+    size_t mask = this->slots.size() - 1;
+    size_t slot = Utils::hash(name.data(), name.size()) & mask;
+
+    while (this->slots[slot] != 0 && this->packages[this->slots[slot] - 1].name != name) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void LPM::Catalog::Catalog::grow() {
+    size_t capacity = std::max<size_t>(16, this->slots.size() * 2);
+    this->slots.assign(capacity, 0);
+
+    for (uint32_t i = 0; i < this->packages.size(); i++) {
+        this->slots[probe(this->packages[i].name)] = i + 1;
+    }
+}
+
+void LPM::Catalog::Catalog::add(
+    const Repository& repository,
+    const std::string& repository_name
+) {
+    std::string_view source = this->strings.intern(repository_name);
+    size_t shadowed = 0;
+
+    for (auto& entry : repository.packages) {
+        if ((this->packages.size() + 1) * 2 > this->slots.size()) {
+            grow();
+        }
+
+        size_t slot = probe(entry.first);
+        if (this->slots[slot] != 0) {
+            shadowed++;
+            continue;
+        }
+
+        const Repository::Package& package = entry.second;
+
+        // std::map keeps versions sorted, which url() relies on. Names
+        // and urls are unique, so they are stored without interning.
+        uint32_t first_version = static_cast<uint32_t>(this->versions.size());
+        for (auto& version : package.versions) {
+            this->versions.push_back(Version {
+                this->strings.intern(version.first),
+                this->strings.store(version.second)
+            });
+        }
+
+        this->packages.push_back(Package {
+            this->strings.store(entry.first),
+            this->strings.intern(package.summary),
+            this->strings.intern(package.package_type),
+            source,
+            first_version,
+            static_cast<uint32_t>(package.versions.size())
+        });
+
+        this->slots[slot] = static_cast<uint32_t>(this->packages.size());
+    }
+
+    LPM_PRINT_DEBUG(
+        "Added repository " << repository_name << " to catalog (" <<
+        repository.packages.size() - shadowed << " packages, " <<
+        shadowed << " shadowed)"
+    );
+}
+
+const LPM::Catalog::Catalog::Package* LPM::Catalog::Catalog::find(std::string_view name) const {
+    if (this->slots.empty()) {
+        return nullptr;
+    }
+
+    uint32_t index = this->slots[probe(name)];
+
+    return index != 0 ? &this->packages[index - 1] : nullptr;
+}
+
+std::string_view LPM::Catalog::Catalog::url(
+    const Package& package,
+    std::string_view version
+) const {
+    const Version* begin = versions_begin(package);
+    const Version* end = versions_end(package);
+
+    const Version* found = std::lower_bound(
+        begin, end, version,
+        [](const Version& a, std::string_view b) { return a.version < b; }
+    );
+
+    if (found == end || found->version != version) {
+        return {};
+    }
+
+    return found->url;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include "manifests.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Catalog {
+    // Owns copies of strings in large blocks. Interned strings are stored
+    // once, and views into the arena stay valid for its whole lifetime.
+    class StringArena {
+    public:
+        StringArena() {}
+
+        StringArena(const StringArena&) = delete;
+        StringArena& operator=(const StringArena&) = delete;
+        StringArena(StringArena&&) = default;
+        StringArena& operator=(StringArena&&) = default;
+
+        std::string_view intern(std::string_view str);
+
+        // Copy a string known to be unique, skipping the deduplication
+        std::string_view store(std::string_view str);
+
+        size_t size() const { return strings.size(); }
+        size_t bytes() const { return allocated; }
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks;
+        std::unordered_set<std::string_view> strings;
+        size_t used = 0, capacity = 0, allocated = 0;
+    };
+
+    // A read-only catalog merging the packages of several repositories.
+    //
+    // Repositories are added from highest to lowest priority. A package
+    // from a repository shadows every package with the same name from the
+    // repositories added after it, versions included, so the result never
+    // depends on hashing or load order within a repository.
+    class Catalog {
+    public:
+        struct Version {
+            std::string_view version, url;
+        };
+
+        struct Package {
+            std::string_view name, summary, package_type, repository;
+            uint32_t first_version, version_count;
+        };
+
+        Catalog() {}
+
+        // Load every repository in Config::repositories, see order()
+        Catalog(const Config& config);
+
+        Catalog(const Catalog&) = delete;
+        Catalog& operator=(const Catalog&) = delete;
+        Catalog(Catalog&&) = default;
+        Catalog& operator=(Catalog&&) = default;
+
+        // Add a repository below every repository added so far
+        void add(const Repository& repository, const std::string& repository_name);
+
+        // Returns nullptr if no repository has the package
+        const Package* find(std::string_view name) const;
+
+        // Returns an empty view if the package has no such version
+        std::string_view url(const Package& package, std::string_view version) const;
+
+        const Version* versions_begin(const Package& package) const {
+            return versions.data() + package.first_version;
+        }
+
+        const Version* versions_end(const Package& package) const {
+            return versions.data() + package.first_version + package.version_count;
+        }
+
+        size_t size() const { return packages.size(); }
+
+        // Source names in Config::repositories, highest priority first. A
+        // source may set an integer 'priority' (lower wins, 0 if unset),
+        // which Config keeps as its decimal string; ties are broken by
+        // source name.
+        static std::vector<std::string> order(const Config& config);
+
+        // The repository file of a source: its 'path' if set, otherwise
+        // <repositories_cache>/<source name>.toml
+        static std::string repository_path(const Config& config, const std::string& source_name);
+    private:
+        StringArena strings;
+        std::vector<Package> packages;
+        std::vector<Version> versions;
+
+        // Open addressing with linear probing, each slot holds a package
+        // index + 1 (0 marks an empty slot). Kept at most half full.
+        std::vector<uint32_t> slots;
+
+        void grow();
+        size_t probe(std::string_view name) const;
+    };
+}
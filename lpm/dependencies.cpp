@@ -1,16 +1,71 @@
+#include <chrono>
 #include <sstream>
+#include <filesystem>
 #include <curl/curl.h>
-#include <zip.h>
 #include "dependencies.h"
+#include "archive.h"
+#include "cache.h"
 #include "manifests.h"
 #include "macros.h"
 #include "scope_destructor.h"
 #include "requests.h"
 #include "env.h"
 #include "utils.h"
+#include "stats.h"
 
 using namespace LPM::Dependencies;
 
+namespace {
+    // Records the outcome and wall time of an install when it goes out
+    // of scope, whichever way the install returned
+    class InstallTimer {
+    public:
+        InstallTimer(const Dependency& dependency)
+        : dependency(dependency), started(std::chrono::steady_clock::now()) {}
+
+        ~InstallTimer() {
+            if (!succeeded) {
+                LPM::Stats::counters().failed_installs++;
+                return;
+            }
+
+            LPM::Stats::counters().installs++;
+            LPM::Stats::record_install(
+                dependency.first,
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count()
+            );
+        }
+
+        bool succeeded = false;
+    private:
+        const Dependency& dependency;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    // Post-extract stage of `source` packages
+    bool build_native_modules(
+        const Dependency& dependency,
+        const std::string& module_path,
+        const LPM::Build::Toolchain* toolchain,
+        std::string& error
+    ) {
+        if (!toolchain) {
+            error = "Dependency " + dependency.first + ":" + dependency.second +
+                " has native modules to build, but no toolchain was given";
+
+            return false;
+        }
+
+        if (!LPM::Build::build(*toolchain, module_path, error)) {
+            error = "Failed to build package " + module_path + " (" + error + ")";
+
+            return false;
+        }
+
+        return true;
+    }
+}
+
 bool LPM::Dependencies::is_installed(const Dependency& dependency) {
     // TODO: Return true if dependency is installed
     // We must take into account the version of the dependency, so
@@ -20,16 +75,37 @@ bool LPM::Dependencies::is_installed(const Dependency& dependency) {
     return false;
 }
 
+bool LPM::Dependencies::index_modules(
+    const Dependency& dependency,
+    const std::string& module_path,
+    Modules::Index& index,
+    std::string& error
+) {
+    try {
+        index.add(dependency.first, module_path);
+    } catch (const std::exception& e) {
+        error = "Failed to update module index: " + std::string(e.what());
+
+        return false;
+    }
+
+    return true;
+}
+
 bool LPM::Dependencies::install(
     const Dependency& dependency,
     Repository::Package& package,
-    std::string cache_path,
-    std::string module_path,
-    std::string& error
+    const std::string& cache_path,
+    const std::string& module_path,
+    std::string& error,
+    Modules::Index* index,
+    const Build::Toolchain* toolchain
 ) {
     // TODO: Download, unpack and install the dependency
     // then add it to our list of installed dependencies in
     // the packages db
+    InstallTimer timer(dependency);
+
     LPM_PRINT_DEBUG(
         "Installing dependency " <<
         dependency.first << ":" <<
@@ -46,11 +122,33 @@ bool LPM::Dependencies::install(
     // Declare the package url
     std::string package_url = package.versions[dependency.second];
 
-    if (package.package_type == "zip") {
+    // cache_path is a direct child of the packages cache
+    std::string cache_root = std::filesystem::path(cache_path).parent_path().string();
+
+    bool cached = false;
+    if (
+        (package.package_type == "zip" || package.package_type == "source") &&
+        dependency.second != "latest" &&
+        std::filesystem::exists(cache_path)
+    ) {
+        // A damaged archive (an interrupted write, a full disk) is simply
+        // downloaded again
+        std::string cache_error;
+        cached = Archive::extract(cache_path, module_path, cache_error);
+
+        if (cached) {
+            LPM_PRINT_DEBUG("Installed " << dependency.first << " from cache " << cache_path);
+            Stats::counters().cache_hits++;
+        } else {
+            LPM_PRINT_DEBUG("Ignoring cached " << cache_path << ": " << cache_error);
+        }
+    }
+
+    if (!cached && (package.package_type == "zip" || package.package_type == "source")) {
         Requests::Response response;
 
         try {
-            scope_destructor<CURL*> curl_handle(curl_easy_init(), curl_easy_cleanup);
+            scope_destructor<CURL*, curl_easy_cleanup> curl_handle(Requests::handle());
             if (!curl_handle.get()) {
                 error = "Failed to initialize curl";
 
@@ -71,8 +169,10 @@ bool LPM::Dependencies::install(
             return false;
         }
 
-        // Save the package to the cache
-        if (!Utils::write_file(cache_path, response.body)) {
+        // Save the package to the cache. Other installs may be extracting
+        // the archive already there out of a mapping, which a rewrite in
+        // place would truncate under them, so it is replaced instead.
+        if (!Utils::replace_file(cache_path, response.body)) {
             error = "Failed to save package cache to " + cache_path;
 
             return false;
@@ -80,37 +180,119 @@ bool LPM::Dependencies::install(
             LPM_PRINT_DEBUG("Saved package cache to " << cache_path);
         }
 
-        try {
-            // Read the package
-            int error_code = 0;
-            scope_destructor<zip*> manifest_zip(
-                zip_open(cache_path.c_str(), 0, &error_code),
-                zip_close
-            );
+        // Extract straight out of the cached archive, mapped in place
+        if (!Archive::extract(cache_path, module_path, error)) {
+            error =
+                "Failed to extract package " + module_path + " (" + error + ")";
 
-            if (!manifest_zip.get()) {
-                error =
-                    "Can't open zip file '" + cache_path + "' " +
-                    "(libzip error code: " + std::to_string(error_code) + ")";
+            return false;
+        }
+    }
 
-                // Cancel manifest_zip destructor to prevent
-                // zip_close from being called
-                manifest_zip.cancel();
+    // Keeps the collector informed, the extracted tree only counts when
+    // it lives in the cache as well
+    if (package.package_type == "zip" || package.package_type == "source") {
+        Cache::touch(cache_root, cache_path);
+        Cache::touch(cache_root, module_path);
+    }
 
-                return false;
-            }
+    if (
+        package.package_type == "source" &&
+        !build_native_modules(dependency, module_path, toolchain, error)
+    ) {
+        return false;
+    }
 
-            if (!Utils::unzip(manifest_zip.get(), module_path, error)) {
-                error =
-                    "Failed to extract package " + module_path + " (" + error + ")";
+    if (index && !index_modules(dependency, module_path, *index, error)) {
+        return false;
+    }
 
-                return false;
-            }
-        } catch (const std::exception& e) {
-            error = "Exception occurred while trying to read package at '" + cache_path + "': " + e.what();
+    timer.succeeded = true;
 
-            return false;
-        }
+    return true;
+}
+
+bool LPM::Dependencies::install(
+    const Dependency& dependency,
+    const Bundle::Reader& bundle,
+    const std::string& module_path,
+    std::string& error,
+    Modules::Index* index,
+    const Build::Toolchain* toolchain
+) {
+    LPM_PRINT_DEBUG(
+        "Installing dependency " <<
+        dependency.first << ":" <<
+        dependency.second << " from bundle " << bundle.path
+    );
+
+    InstallTimer timer(dependency);
+
+    const Bundle::Entry* entry = bundle.find(dependency.first, dependency.second);
+    if (!entry) {
+        error =
+            "Dependency " + dependency.first + ":" + dependency.second +
+            " is not in bundle " + bundle.path;
+
+        return false;
+    }
+
+    if (entry->package_type != "zip" && entry->package_type != "source") {
+        error = "Unsupported package type '" + entry->package_type + "' in bundle " + bundle.path;
+
+        return false;
+    }
+
+    // Extract in place, straight out of the mapped bundle
+    if (!Archive::extract(
+        bundle.data(*entry), entry->size,
+        bundle.descriptor(), entry->offset,
+        module_path, error
+    )) {
+        error =
+            "Failed to extract package " + module_path + " (" + error + ")";
+
+        return false;
+    }
+
+    if (
+        entry->package_type == "source" &&
+        !build_native_modules(dependency, module_path, toolchain, error)
+    ) {
+        return false;
+    }
+
+    if (index && !index_modules(dependency, module_path, *index, error)) {
+        return false;
+    }
+
+    timer.succeeded = true;
+
+    return true;
+}
+
+bool LPM::Dependencies::uninstall(
+    const Dependency& dependency,
+    const std::string& module_path,
+    std::string& error,
+    Modules::Index* index
+) {
+    LPM_PRINT_DEBUG(
+        "Uninstalling dependency " <<
+        dependency.first << ":" <<
+        dependency.second
+    );
+
+    std::error_code remove_error;
+    std::filesystem::remove_all(module_path, remove_error);
+    if (remove_error) {
+        error = "Failed to remove " + module_path + ": " + remove_error.message();
+
+        return false;
+    }
+
+    if (index) {
+        index->remove(dependency.first);
     }
 
     return true;
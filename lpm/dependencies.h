@@ -2,6 +2,9 @@
 #include <string>
 #include <utility>
 #include "manifests.h"
+#include "bundle.h"
+#include "build.h"
+#include "modules.h"
 
 using namespace LPM::Manifests;
 
@@ -10,12 +13,53 @@ namespace LPM::Dependencies {
 
     bool is_installed(const Dependency& dependency);
 
+    // Record the modules of a freshly installed dependency in the index
+    // (but don't save it)
+    bool index_modules(
+        const Dependency& dependency,
+        const std::string& module_path,
+        Modules::Index& index,
+        std::string& error
+    );
+
+    // Download and extract a dependency. Packages of type `source` are
+    // zip archives whose native modules then get built with toolchain,
+    // which they can't be installed without.
+    //
+    // The archive is kept at cache_path, normally Cache::archive_path().
+    // When an archive is already there (and the version isn't "latest")
+    // it is extracted instead of downloading the package again.
+    //
+    // The modules go into index when there is one, which is left for the
+    // caller to save once every dependency is installed.
     bool install(
         const Dependency& dependency,
         Repository::Package& package,
-        std::string cache_path,
-        std::string package_path,
-        std::string& error
+        const std::string& cache_path,
+        const std::string& package_path,
+        std::string& error,
+        Modules::Index* index = nullptr,
+        const Build::Toolchain* toolchain = nullptr
+    );
+
+    // Install a dependency from a prefetch bundle without touching the
+    // network or the packages cache. Like above, index isn't saved.
+    bool install(
+        const Dependency& dependency,
+        const Bundle::Reader& bundle,
+        const std::string& module_path,
+        std::string& error,
+        Modules::Index* index = nullptr,
+        const Build::Toolchain* toolchain = nullptr
+    );
+
+    // Remove an installed dependency and drop its modules from the index,
+    // which the caller saves
+    bool uninstall(
+        const Dependency& dependency,
+        const std::string& module_path,
+        std::string& error,
+        Modules::Index* index = nullptr
     );
 
     bool unpack(const std::string& package_url, const std::string& package_path);
@@ -1,17 +1,33 @@
 #include "env.h"
 #include "macros.h"
 
-std::string LPM::Env::get(std::string key, std::string default_value ) {
-    const char* value = std::getenv(key.c_str());
+namespace {
+    // getenv wants a terminated key: short ones are copied to the stack,
+    // only unusually long keys allocate
+    const char* lookup(std::string_view key) {
+        char buffer[128];
+        if (key.size() >= sizeof(buffer)) {
+            return std::getenv(std::string(key).c_str());
+        }
+
+        key.copy(buffer, key.size());
+        buffer[key.size()] = '\0';
+
+        return std::getenv(buffer);
+    }
+}
+
+std::string LPM::Env::get(std::string_view key, std::string_view default_value) {
+    const char* value = lookup(key);
     if (value == NULL) {
-        return default_value;
+        return std::string(default_value);
     }
 
     return value;
 }
 
-int LPM::Env::get(std::string key, int default_value) {
-    const char* value = std::getenv(key.c_str());
+int LPM::Env::get(std::string_view key, int default_value) {
+    const char* value = lookup(key);
 
     if (value == NULL) {
         return default_value;
@@ -29,8 +45,10 @@ void LPM::Env::fill_env_vars(std::string& path, bool replace_empty) {
             break;
         }
 
-        std::string key = path.substr(start_pos + 2, end_pos - start_pos - 2);
-        std::string value = get(key, "");
+        std::string value = get(
+            std::string_view(path).substr(start_pos + 2, end_pos - start_pos - 2),
+            ""
+        );
         if (value == "" and replace_empty || value != "") {
             path.replace(start_pos, end_pos - start_pos + 1, value);
         }
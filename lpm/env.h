@@ -1,10 +1,11 @@
 #pragma once
 #include <cstdlib>
 #include <string>
+#include <string_view>
 
 namespace LPM::Env {
-    std::string get(std::string key, std::string default_value );
-    int get(std::string key, int default_value);
+    std::string get(std::string_view key, std::string_view default_value);
+    int get(std::string_view key, int default_value);
 
     void fill_env_vars(std::string& path, bool replace_empty = true);
 }
\ No newline at end of file
@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include "fetch.h"
+#include "env.h"
+#include "macros.h"
+#include "scope_destructor.h"
+#include "stats.h"
+
+namespace {
+    // Latency counts as inflated past this multiple of the best one seen,
+    // plus a little slack so a sub-millisecond baseline isn't too strict
+    const double LATENCY_INFLATION = 2.0;
+    const double LATENCY_SLACK_SECONDS = 0.005;
+
+    // Going from n to m requests in flight can at best improve throughput
+    // by (m - n) / n, a step has to deliver this share of it to stay
+    const double THROUGHPUT_GAIN = 0.5;
+
+    // First retry delay without a Retry-After, doubled on every attempt
+    const double BASE_BACKOFF_SECONDS = 0.25;
+
+    double seconds(LPM::Fetch::Clock::duration duration) {
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    LPM::Fetch::Clock::duration duration(double seconds) {
+        return std::chrono::duration_cast<LPM::Fetch::Clock::duration>(
+            std::chrono::duration<double>(seconds)
+        );
+    }
+}
+
+LPM::Fetch::Limits LPM::Fetch::Limits::from_env() {
+    Limits limits;
+    limits.max = static_cast<unsigned int>(
+        std::max(1, Env::get("LPM_MAX_DOWNLOADS", static_cast<int>(limits.max)))
+    );
+
+    return limits;
+}
+
+LPM::Fetch::Window::Window(std::string _host, const Limits& _limits)
+: host(std::move(_host)),
+  window(std::clamp(_limits.initial, _limits.min, _limits.per_host)),
+  limits(_limits),
+  step_started(Clock::now()),
+  step_window(std::floor(window)) {}
+
+void LPM::Fetch::Window::set(double value, const char* reason) {
+    value = std::clamp(value, limits.min, limits.per_host);
+
+    Stats::Counters& counters = Stats::counters();
+    if (value > window) {
+        counters.fetch_increases++;
+    } else if (value < window) {
+        counters.fetch_decreases++;
+    } else {
+        counters.fetch_holds++;
+    }
+
+    // Only log what changes the number of requests in flight, or why
+    bool changed = std::floor(value) != std::floor(window) || reason != last_reason;
+    window = value;
+
+    if (changed) {
+        last_reason = reason;
+        Stats::record_window(host, window, reason);
+    }
+}
+
+void LPM::Fetch::Window::success(
+    Clock::time_point now,
+    double first_byte_seconds,
+    std::uint64_t bytes
+) {
+    step_bytes += bytes;
+
+    if (first_byte_seconds > 0) {
+        base_latency = base_latency > 0 ? std::min(base_latency, first_byte_seconds) : first_byte_seconds;
+        latency = latency > 0 ? 0.8 * latency + 0.2 * first_byte_seconds : first_byte_seconds;
+    }
+
+    // Requests are queueing on the server or the link already
+    if (latency > base_latency * LATENCY_INFLATION + LATENCY_SLACK_SECONDS) {
+        slow_start = false;
+        set(window, "latency");
+        return;
+    }
+
+    if (plateau_successes > 0) {
+        plateau_successes--;
+        set(window, "throughput");
+        return;
+    }
+
+    set(window + (slow_start ? 1 : 1 / window), slow_start ? "slow start" : "success");
+
+    // Steps double the window in slow start, and add one after that
+    double target = std::floor(slow_start ? 2 * step_window : step_window + 1);
+    if (window < target) {
+        return;
+    }
+
+    // A whole step was added, see whether it bought anything
+    double elapsed = seconds(now - step_started);
+    double throughput = elapsed > 0 ? step_bytes / elapsed : 0;
+    double ideal_gain = (target - step_window) / step_window;
+
+    if (step_throughput > 0 && throughput < step_throughput * (1 + THROUGHPUT_GAIN * ideal_gain)) {
+        // Step back and stay there for a few windows before probing again
+        set(step_window, "throughput");
+        slow_start = false;
+        plateau_successes = static_cast<unsigned int>(4 * window);
+    } else {
+        step_throughput = throughput;
+    }
+
+    step_window = std::floor(window);
+    step_started = now;
+    step_bytes = 0;
+}
+
+void LPM::Fetch::Window::congestion(Clock::time_point now, double retry_after_seconds) {
+    if (retry_after_seconds > 0) {
+        blocked_until = std::max(
+            blocked_until,
+            now + duration(std::min(retry_after_seconds, limits.max_backoff_seconds))
+        );
+    }
+
+    // Responses to requests sent before the last decrease tell nothing
+    // new, halve at most once per round trip
+    if (seconds(now - last_decrease) < std::max(latency, LATENCY_SLACK_SECONDS)) {
+        return;
+    }
+
+    set(window / 2, "congestion");
+    last_decrease = now;
+    slow_start = false;
+
+    // Measurements from before are stale
+    step_window = std::floor(window);
+    step_started = now;
+    step_bytes = 0;
+    step_throughput = 0;
+    plateau_successes = 0;
+}
+
+bool LPM::Fetch::retryable(const Requests::Response& response) {
+    switch (response.status_code) {
+        case 0:     // no response at all
+        case 408:
+        case 425:
+        case 429:
+        case 500:
+        case 502:
+        case 503:
+        case 504:
+            return true;
+        default:
+            return false;
+    }
+}
+
+double LPM::Fetch::retry_after(const Requests::Response& response) {
+    auto header = response.headers.find("retry-after");
+    if (header == response.headers.end() || header->second.empty()) {
+        return -1;
+    }
+
+    const std::string& value = header->second;
+
+    if (std::all_of(value.begin(), value.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+        // strtod rather than stod, which throws on values out of range
+        // and would take the download thread (and the process) down.
+        // Those become HUGE_VAL, callers clamp the wait anyway.
+        errno = 0;
+        double seconds = std::strtod(value.c_str(), nullptr);
+
+        return errno == ERANGE ? HUGE_VAL : seconds;
+    }
+
+    long date = curl_getdate(value.c_str(), nullptr);
+    if (date < 0) {
+        return -1;
+    }
+
+    return std::max(0.0, std::difftime(static_cast<std::time_t>(date), std::time(nullptr)));
+}
+
+std::string LPM::Fetch::host(const std::string& url) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+
+    size_t end = url.find_first_of("/?#", start);
+    std::string authority = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos) {
+        authority.erase(0, at + 1);
+    }
+
+    for (auto& c : authority) {
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+
+    return authority;
+}
+
+std::vector<LPM::Requests::Response> LPM::Fetch::get_all(
+    const std::vector<Request>& requests,
+    const Limits& limits
+) {
+    std::vector<Requests::Response> responses(requests.size());
+
+    get_each(requests, [&](size_t index, Requests::Response& response) {
+        responses[index] = std::move(response);
+    }, limits);
+
+    return responses;
+}
+
+void LPM::Fetch::get_each(
+    const std::vector<Request>& requests,
+    const std::function<void(size_t, Requests::Response&)>& done,
+    const Limits& limits
+) {
+    struct Pending {
+        size_t index;
+        unsigned int attempt;
+        Clock::time_point not_before;
+    };
+
+    std::vector<std::string> hosts;
+    std::map<std::string, Window> windows;
+    std::deque<Pending> pending;
+
+    hosts.reserve(requests.size());
+    for (size_t i = 0; i < requests.size(); i++) {
+        hosts.push_back(host(requests[i].url));
+        windows.try_emplace(hosts.back(), hosts.back(), limits);
+        pending.push_back(Pending { i, 0, Clock::time_point() });
+    }
+
+    // done has a lock of its own, so a slow consumer never holds up
+    // the scheduling of other downloads
+    std::mutex mutex, done_mutex;
+    std::condition_variable changed;
+    size_t remaining = requests.size();
+    unsigned int in_flight = 0;
+
+    auto update_gauge = [&]() {
+        std::uint64_t total = 0;
+        for (auto& window : windows) {
+            total += static_cast<std::uint64_t>(window.second.window);
+        }
+
+        Stats::counters().fetch_window = std::min<std::uint64_t>(total, limits.max);
+    };
+
+    update_gauge();
+
+    auto worker = [&]() {
+        // One handle per worker, so connections are kept alive
+        scope_destructor<CURL*, curl_easy_cleanup> curl_handle(Requests::handle());
+        if (!curl_handle.get()) {
+            curl_handle.cancel();
+            LPM_PRINT_ERROR("Failed to initialize curl for a download worker");
+
+            return;
+        }
+
+        std::minstd_rand random(std::random_device {}());
+        std::uniform_real_distribution<double> jitter(0.5, 1.5);
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (remaining > 0) {
+            // Take the first request whose host has room for it
+            Clock::time_point now = Clock::now();
+            Clock::time_point wake = now + std::chrono::seconds(1);
+            auto job = pending.end();
+
+            for (auto it = pending.begin(); it != pending.end() && in_flight < limits.max; ++it) {
+                Window& window = windows.at(hosts[it->index]);
+
+                if (it->not_before > now) {
+                    wake = std::min(wake, it->not_before);
+                } else if (window.admits(now)) {
+                    job = it;
+                    break;
+                } else if (window.blocked_until > now) {
+                    wake = std::min(wake, window.blocked_until);
+                }
+            }
+
+            if (job == pending.end()) {
+                changed.wait_until(lock, wake);
+                continue;
+            }
+
+            Pending current = *job;
+            pending.erase(job);
+
+            const Request& request = requests[current.index];
+            Window& window = windows.at(hosts[current.index]);
+            window.in_flight++;
+            in_flight++;
+
+            lock.unlock();
+
+            Requests::Response response = Requests::get(request.url, curl_handle.get(), request.headers);
+            double first_byte = 0;
+            curl_easy_getinfo(curl_handle.get(), CURLINFO_STARTTRANSFER_TIME, &first_byte);
+
+            lock.lock();
+            window.in_flight--;
+            in_flight--;
+            now = Clock::now();
+
+            if (retryable(response)) {
+                double wait = std::min(retry_after(response), limits.max_backoff_seconds);
+                window.congestion(now, wait);
+
+                if (current.attempt < limits.retries) {
+                    if (wait < 0) {
+                        wait = BASE_BACKOFF_SECONDS * std::pow(2.0, current.attempt) * jitter(random);
+                    }
+
+                    LPM_PRINT_DEBUG(
+                        "Retrying " << request.url << " (" << response.status_code << ") in " <<
+                        std::min(wait, limits.max_backoff_seconds) << "s"
+                    );
+
+                    Stats::counters().fetch_retries++;
+                    pending.push_back(Pending {
+                        current.index, current.attempt + 1,
+                        now + duration(std::min(wait, limits.max_backoff_seconds))
+                    });
+
+                    update_gauge();
+                    changed.notify_all();
+
+                    continue;
+                }
+            } else if (response.status_code < 400) {
+                window.success(now, first_byte, response.body.size());
+            } else {
+                // 404 and other client errors say nothing about how much
+                // the host can take, the window stays where it is
+            }
+
+            remaining--;
+
+            update_gauge();
+            changed.notify_all();
+            lock.unlock();
+
+            {
+                std::lock_guard<std::mutex> done_lock(done_mutex);
+                done(current.index, response);
+            }
+
+            lock.lock();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < std::min<size_t>(limits.max, requests.size()); i++) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    // Left over when no worker could get a curl handle
+    for (auto& left : pending) {
+        Requests::Response response("", requests[left.index].url, 0);
+        done(left.index, response);
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "requests.h"
+
+namespace LPM::Fetch {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Limits {
+        // Parallel downloads per host: where each host starts, and the
+        // bounds its window moves between
+        double initial = 4, min = 1, per_host = 32;
+
+        // Parallel downloads across all hosts
+        unsigned int max = 64;
+
+        // Attempts after the first one for retryable failures, and the
+        // longest we ever wait before one (Retry-After included)
+        unsigned int retries = 4;
+        double max_backoff_seconds = 60;
+
+        // Defaults, with max taken from LPM_MAX_DOWNLOADS when it is set
+        static Limits from_env();
+    };
+
+    // Congestion window of a single host, grown and shrunk AIMD-style:
+    //
+    //   success          +1/window (about +1 per window of responses),
+    //                    unless latency or throughput says otherwise. Until
+    //                    the first sign of trouble (slow start) it is +1,
+    //                    doubling every window instead.
+    //   time to first    hold: more parallel requests only queue up
+    //   byte > 2x best
+    //   throughput flat  hold for a while: the link is saturated
+    //   429, 5xx, reset  window / 2, at most once per round trip
+    //   Retry-After      no new request until it passes (at most
+    //                    max_backoff_seconds)
+    //   other 4xx        nothing, the host answered normally
+    class Window {
+    public:
+        Window(std::string host, const Limits& limits);
+
+        std::string host;
+        double window;
+        unsigned int in_flight = 0;
+        Clock::time_point blocked_until;
+
+        bool admits(Clock::time_point now) const {
+            return now >= blocked_until && in_flight < static_cast<unsigned int>(window);
+        }
+
+        // Feed back the outcome of one request. first_byte_seconds and
+        // bytes describe a successful response.
+        void success(Clock::time_point now, double first_byte_seconds, std::uint64_t bytes);
+        void congestion(Clock::time_point now, double retry_after_seconds);
+    private:
+        Limits limits;
+
+        // Best time to first byte seen, and its moving average
+        double base_latency = 0, latency = 0;
+        Clock::time_point last_decrease;
+
+        bool slow_start = true;
+
+        // Throughput measured over each whole step of the window
+        Clock::time_point step_started;
+        double step_window;
+        std::uint64_t step_bytes = 0;
+        double step_throughput = 0;
+        unsigned int plateau_successes = 0;
+
+        std::string last_reason;
+
+        void set(double value, const char* reason);
+    };
+
+    struct Request {
+        std::string url;
+        std::map<std::string, std::string> headers;
+    };
+
+    // Whether a response is worth retrying later: throttling, an
+    // overloaded or unreachable server
+    bool retryable(const Requests::Response& response);
+
+    // Seconds to wait from a Retry-After header (delta seconds or an HTTP
+    // date), -1 if there is none
+    double retry_after(const Requests::Response& response);
+
+    // Host (and port) part of a url
+    std::string host(const std::string& url);
+
+    // Download every request, as many at once as each host's window
+    // allows, retrying throttled and failed ones. Responses come back in
+    // request order, after their last attempt.
+    std::vector<Requests::Response> get_all(
+        const std::vector<Request>& requests,
+        const Limits& limits = Limits::from_env()
+    );
+
+    // Same downloads, but each response goes to done (with the index of
+    // its request) right after its last attempt instead of being kept,
+    // so only the bodies in flight are ever held in memory. done is
+    // called exactly once per request (status 0 if it never ran), from
+    // the download threads, one call at a time.
+    void get_each(
+        const std::vector<Request>& requests,
+        const std::function<void(size_t, Requests::Response&)>& done,
+        const Limits& limits = Limits::from_env()
+    );
+}
@@ -0,0 +1,543 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include "io.h"
+#include "env.h"
+#include "macros.h"
+#include "stats.h"
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+    std::string describe(const std::string& what, const std::string& path, int error_number) {
+        return "Failed to " + what + " " + path + " (" + std::strerror(error_number) + ")";
+    }
+
+    class PortableBackend : public LPM::IO::Backend {
+    public:
+        const char* name() const override { return "portable"; }
+    protected:
+        bool submit(
+            const std::vector<std::string>& directories,
+            const std::vector<File>& files,
+            std::string& error
+        ) override {
+            // A directory that can't be created shows up as a failure to
+            // open the files inside it
+            for (auto& directory : directories) {
+                std::error_code fs_error;
+                if (fs::create_directory(directory, fs_error)) {
+                    LPM::Stats::counters().directories_created++;
+                }
+            }
+
+            for (auto& file : files) {
+                if (!write_file(file, error)) {
+                    return false;
+                }
+
+                LPM::Stats::counters().files_written++;
+                LPM::Stats::counters().bytes_written += file.size;
+            }
+
+            return true;
+        }
+    private:
+        static bool write_file(const File& file, std::string& error) {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+            int descriptor = ::open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (descriptor < 0) {
+                error = describe("open", file.path, errno);
+
+                return false;
+            }
+
+            size_t written = 0;
+            while (written < file.size) {
+                ssize_t result = ::write(descriptor, file.bytes() + written, file.size - written);
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (result <= 0) {
+                    error = describe("write", file.path, errno);
+                    ::close(descriptor);
+
+                    return false;
+                }
+
+                written += result;
+            }
+
+            if (::close(descriptor) != 0) {
+                error = describe("write", file.path, errno);
+
+                return false;
+            }
+#else
+            std::ofstream stream(file.path, std::ios::binary | std::ios::trunc);
+            if (!stream.is_open() || !stream.write(file.bytes(), file.size)) {
+                error = "Failed to write " + file.path;
+
+                return false;
+            }
+#endif
+
+            return true;
+        }
+    };
+
+#if defined(__linux__)
+    int io_uring_setup(unsigned int entries, io_uring_params* params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int io_uring_enter(int ring, unsigned int submit, unsigned int complete, unsigned int flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ring, submit, complete, flags, nullptr, 0));
+    }
+
+    int io_uring_register(int ring, unsigned int opcode, const void* arg, unsigned int count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, ring, opcode, arg, count));
+    }
+
+    // Writes larger than this are split, a single one is capped by the
+    // kernel anyway
+    const size_t MAX_WRITE = 1 << 30;
+
+    class UringBackend : public LPM::IO::Backend {
+    public:
+        ~UringBackend() override {
+            if (sqes) munmap(sqes, sqes_size);
+            if (cq_mapping && cq_mapping != sq_mapping) munmap(cq_mapping, cq_size);
+            if (sq_mapping) munmap(sq_mapping, sq_size);
+            if (ring >= 0) ::close(ring);
+        }
+
+        const char* name() const override { return "io_uring"; }
+
+        bool setup(std::string& error) {
+            io_uring_params params {};
+            ring = io_uring_setup(LPM_IO_URING_ENTRIES, &params);
+            if (ring < 0) {
+                error = std::string("io_uring_setup: ") + std::strerror(errno);
+
+                return false;
+            }
+
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_size = cq_size = std::max(sq_size, cq_size);
+            }
+
+            sq_mapping = map(sq_size, IORING_OFF_SQ_RING);
+            cq_mapping = single_mmap ? sq_mapping : map(cq_size, IORING_OFF_CQ_RING);
+            sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+
+            if (!sq_mapping || !cq_mapping || !sqes) {
+                error = std::string("io_uring mmap: ") + std::strerror(errno);
+
+                return false;
+            }
+
+            char* sq = static_cast<char*>(sq_mapping);
+            sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+            sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+            sq_entries = params.sq_entries;
+
+            char* cq = static_cast<char*>(cq_mapping);
+            cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+            cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+            // Everything we issue has to be there (mkdirat and direct
+            // descriptors both came with 5.15)
+            std::vector<char> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+            auto* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+
+            if (io_uring_register(ring, IORING_REGISTER_PROBE, probe, 256) < 0) {
+                error = std::string("io_uring probe: ") + std::strerror(errno);
+
+                return false;
+            }
+
+            for (int opcode : { IORING_OP_MKDIRAT, IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+                if (
+                    opcode > probe->last_op ||
+                    !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)
+                ) {
+                    error = "io_uring lacks opcode " + std::to_string(opcode);
+
+                    return false;
+                }
+            }
+
+            // Files are opened straight into these slots, so a chain can
+            // refer to the descriptor before it exists
+            std::vector<int> slots(LPM_IO_URING_FILES, -1);
+            if (io_uring_register(ring, IORING_REGISTER_FILES, slots.data(), slots.size()) < 0) {
+                error = std::string("io_uring file slots: ") + std::strerror(errno);
+
+                return false;
+            }
+
+            return true;
+        }
+    protected:
+        bool submit(
+            const std::vector<std::string>& directories,
+            const std::vector<File>& files,
+            std::string& error
+        ) override {
+            // A level only starts once its parents exist
+            std::vector<std::vector<const std::string*>> levels;
+            for (auto& directory : directories) {
+                size_t depth = std::count(directory.begin(), directory.end(), '/');
+                if (levels.size() <= depth) {
+                    levels.resize(depth + 1);
+                }
+
+                levels[depth].push_back(&directory);
+            }
+
+            for (auto& level : levels) {
+                for (size_t start = 0; start < level.size(); start += sq_entries) {
+                    size_t count = std::min<size_t>(sq_entries, level.size() - start);
+
+                    for (size_t i = 0; i < count; i++) {
+                        io_uring_sqe* sqe = next_sqe();
+                        sqe->opcode = IORING_OP_MKDIRAT;
+                        sqe->fd = AT_FDCWD;
+                        sqe->addr = reinterpret_cast<std::uint64_t>(level[start + i]->c_str());
+                        sqe->len = 0777;
+                        sqe->user_data = start + i;
+                    }
+
+                    // As with the portable backend, failures surface when
+                    // opening the files inside
+                    if (!run(count, error, [&](std::uint64_t, int result) {
+                        if (result == 0) {
+                            LPM::Stats::counters().directories_created++;
+                        }
+                    })) {
+                        return false;
+                    }
+                }
+            }
+
+            // Chains of open, write(s) and close, as many files at once as
+            // there are slots and room in the queue
+            size_t index = 0;
+            while (index < files.size()) {
+                size_t queued = 0, slot = 0, first = index;
+
+                while (index < files.size() && slot < LPM_IO_URING_FILES) {
+                    const File& file = files[index];
+                    size_t writes = (file.size + MAX_WRITE - 1) / MAX_WRITE;
+                    if (queued + writes + 2 > sq_entries) {
+                        break;
+                    }
+
+                    std::uint64_t tag = static_cast<std::uint64_t>(index) << 8;
+
+                    io_uring_sqe* sqe = next_sqe();
+                    sqe->opcode = IORING_OP_OPENAT;
+                    sqe->flags = IOSQE_IO_LINK;
+                    sqe->fd = AT_FDCWD;
+                    sqe->addr = reinterpret_cast<std::uint64_t>(file.path.c_str());
+                    sqe->len = 0666;
+                    // Direct descriptors never reach the process table, the
+                    // kernel rejects O_CLOEXEC for them
+                    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+                    sqe->file_index = slot + 1;
+                    sqe->user_data = tag | OPEN;
+
+                    // Hard links keep the chain going after a failed or
+                    // short write, so the close still runs and releases
+                    // the slot. A plain link would cancel it, and no link
+                    // at all would let it run before the open.
+                    for (size_t offset = 0; offset < file.size; offset += MAX_WRITE) {
+                        sqe = next_sqe();
+                        sqe->opcode = IORING_OP_WRITE;
+                        sqe->flags = IOSQE_IO_HARDLINK | IOSQE_FIXED_FILE;
+                        sqe->fd = static_cast<int>(slot);
+                        sqe->addr = reinterpret_cast<std::uint64_t>(file.bytes() + offset);
+                        sqe->len = static_cast<unsigned int>(std::min(MAX_WRITE, file.size - offset));
+                        sqe->off = offset;
+                        sqe->user_data = tag | WRITE;
+                    }
+
+                    sqe = next_sqe();
+                    sqe->opcode = IORING_OP_CLOSE;
+                    sqe->file_index = slot + 1;
+                    sqe->user_data = tag | CLOSE;
+
+                    queued += writes + 2;
+                    slot++;
+                    index++;
+                }
+
+                std::vector<size_t> written(index - first, 0);
+                std::string failure;
+
+                if (!run(queued, error, [&](std::uint64_t user_data, int result) {
+                    size_t file = user_data >> 8;
+                    const char* what = (user_data & 0xFF) == OPEN ? "open" :
+                        (user_data & 0xFF) == WRITE ? "write" : "close";
+
+                    if (result < 0) {
+                        // The rest of a failed chain is cancelled, report
+                        // what actually went wrong
+                        if (failure.empty() && result != -ECANCELED) {
+                            failure = describe(what, files[file].path, -result);
+                        }
+                    } else if ((user_data & 0xFF) == WRITE) {
+                        written[file - first] += result;
+                    }
+                })) {
+                    return false;
+                }
+
+                if (!failure.empty()) {
+                    error = failure;
+
+                    return false;
+                }
+
+                for (size_t i = first; i < index; i++) {
+                    if (written[i - first] != files[i].size) {
+                        error = "Short write to " + files[i].path;
+
+                        return false;
+                    }
+
+                    LPM::Stats::counters().files_written++;
+                    LPM::Stats::counters().bytes_written += files[i].size;
+                }
+            }
+
+            return true;
+        }
+    private:
+        enum Operation : std::uint64_t { OPEN, WRITE, CLOSE };
+
+        int ring = -1;
+        void *sq_mapping = nullptr, *cq_mapping = nullptr;
+        size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+
+        io_uring_sqe* sqes = nullptr;
+        unsigned int *sq_tail = nullptr, *sq_array = nullptr, sq_mask = 0, sq_entries = 0;
+        unsigned int *cq_head = nullptr, *cq_tail = nullptr, cq_mask = 0;
+        io_uring_cqe* cqes = nullptr;
+        unsigned int pending = 0;
+
+        void* map(size_t size, off_t offset) {
+            void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+
+            return mapping == MAP_FAILED ? nullptr : mapping;
+        }
+
+        // We are the only producer, the kernel only reads the tail
+        io_uring_sqe* next_sqe() {
+            unsigned int tail = *sq_tail + pending;
+            unsigned int index = tail & sq_mask;
+
+            io_uring_sqe* sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sq_array[index] = index;
+            pending++;
+
+            return sqe;
+        }
+
+        // Submit everything queued and wait for its count completions
+        template <class Callback>
+        bool run(size_t count, std::string& error, Callback on_completion) {
+            __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+
+            unsigned int to_submit = pending;
+            pending = 0;
+
+            size_t completed = 0;
+            while (completed < count) {
+                int result = io_uring_enter(
+                    ring, to_submit, static_cast<unsigned int>(count - completed), IORING_ENTER_GETEVENTS
+                );
+
+                if (result < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+
+                    error = std::string("io_uring_enter: ") + std::strerror(errno);
+
+                    return false;
+                }
+
+                to_submit -= std::min<unsigned int>(to_submit, result);
+
+                unsigned int head = *cq_head;
+                unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+                for (; head != tail; head++, completed++) {
+                    const io_uring_cqe& cqe = cqes[head & cq_mask];
+                    on_completion(cqe.user_data, cqe.res);
+                }
+
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+
+            return true;
+        }
+    };
+#endif
+}
+
+bool LPM::IO::Backend::write(
+    const std::string& path,
+    const char* data,
+    size_t size,
+    std::string& error
+) {
+    parents(path);
+
+    File file;
+    file.path = path;
+    file.data = data;
+    file.size = size;
+    files.push_back(std::move(file));
+
+    return maybe_flush(error);
+}
+
+bool LPM::IO::Backend::write(
+    const std::string& path,
+    std::string content,
+    std::string& error
+) {
+    parents(path);
+
+    File file;
+    file.path = path;
+    file.size = content.size();
+    file.content = std::move(content);
+    file.owned = true;
+
+    owned_bytes += file.size;
+    files.push_back(std::move(file));
+
+    return maybe_flush(error);
+}
+
+void LPM::IO::Backend::directory(const std::string& path) {
+    std::string trimmed = path;
+    while (trimmed.size() > 1 && trimmed.back() == '/') {
+        trimmed.pop_back();
+    }
+
+    parents(trimmed + "/");
+}
+
+bool LPM::IO::Backend::flush(std::string& error) {
+    if (directories.empty() && files.empty()) {
+        return true;
+    }
+
+    bool submitted = submit(directories, files, error);
+    discard();
+
+    return submitted;
+}
+
+void LPM::IO::Backend::discard() {
+    directories.clear();
+    files.clear();
+    owned_bytes = 0;
+
+    // Directories may be removed between batches (uninstall, cache
+    // eviction), each batch creates what it needs again
+    known.clear();
+}
+
+void LPM::IO::Backend::parents(const std::string& path) {
+    // Walk up until a known directory, then queue the missing ones from
+    // the top down. Ones that already exist just fail with EEXIST, once.
+    size_t end = path.find_last_of('/');
+    size_t first = directories.size();
+
+    while (end != std::string::npos && end > 0) {
+        std::string parent = path.substr(0, end);
+        if (!known.insert(parent).second) {
+            break;
+        }
+
+        directories.push_back(std::move(parent));
+        end = path.find_last_of('/', end - 1);
+    }
+
+    std::reverse(directories.begin() + first, directories.end());
+}
+
+bool LPM::IO::Backend::maybe_flush(std::string& error) {
+    if (files.size() < LPM_IO_BATCH_FILES && owned_bytes < LPM_IO_BATCH_BYTES) {
+        return true;
+    }
+
+    return flush(error);
+}
+
+std::unique_ptr<LPM::IO::Backend> LPM::IO::portable() {
+    return std::make_unique<PortableBackend>();
+}
+
+std::unique_ptr<LPM::IO::Backend> LPM::IO::uring() {
+#if defined(__linux__)
+    auto backend = std::make_unique<UringBackend>();
+    std::string error;
+
+    if (!backend->setup(error)) {
+        LPM_PRINT_DEBUG("io_uring backend unavailable: " << error);
+
+        return nullptr;
+    }
+
+    return backend;
+#else
+    return nullptr;
+#endif
+}
+
+std::unique_ptr<LPM::IO::Backend> LPM::IO::create() {
+    if (Env::get("LPM_IO_BACKEND", "") != "portable") {
+        if (auto backend = uring()) {
+            return backend;
+        }
+    }
+
+    return portable();
+}
+
+LPM::IO::Backend& LPM::IO::local() {
+    thread_local std::unique_ptr<Backend> backend = create();
+
+    return *backend;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace LPM::IO {
+    // Batches file writes, so backends can issue them together instead of
+    // one open/write/close (and mkdir) at a time:
+    //
+    //   Backend& io = IO::local();
+    //   io.write("lpm_modules/foo/init.lua", data, size, error);
+    //   io.write("lpm_modules/foo/bar.lua", std::move(content), error);
+    //   io.flush(error);
+    //
+    // Missing parent directories are created along the way. Nothing is
+    // guaranteed to be on disk before flush() returns true, queueing may
+    // flush early once enough is pending.
+    class Backend {
+    public:
+        virtual ~Backend() {}
+
+        virtual const char* name() const = 0;
+
+        // Queue a whole file, data must stay valid until the next flush
+        bool write(const std::string& path, const char* data, size_t size, std::string& error);
+
+        // Queue a whole file, keeping its content alive meanwhile
+        bool write(const std::string& path, std::string content, std::string& error);
+
+        // Queue a directory and its missing parents
+        void directory(const std::string& path);
+
+        bool flush(std::string& error);
+
+        // Drop what is queued without writing it
+        void discard();
+    protected:
+        struct File {
+            std::string path, content;
+            const char* data = nullptr;
+            size_t size = 0;
+            bool owned = false;
+
+            const char* bytes() const { return owned ? content.data() : data; }
+        };
+
+        // Directories in creation order (parents first), then files
+        virtual bool submit(
+            const std::vector<std::string>& directories,
+            const std::vector<File>& files,
+            std::string& error
+        ) = 0;
+    private:
+        std::vector<std::string> directories;
+        std::vector<File> files;
+        size_t owned_bytes = 0;
+
+        // Directories queued in the current batch, never created twice
+        std::set<std::string> known;
+
+        void parents(const std::string& path);
+        bool maybe_flush(std::string& error);
+    };
+
+    // Plain blocking calls, one file at a time. Works everywhere.
+    std::unique_ptr<Backend> portable();
+
+    // io_uring: directories are created in one submission per tree level,
+    // then each file is opened, written and closed by a linked chain of
+    // requests, many files per submission. Returns nullptr when the kernel
+    // can't do it (older than 5.15, or io_uring disabled or filtered).
+    std::unique_ptr<Backend> uring();
+
+    // The best backend available, io_uring first unless LPM_IO_BACKEND is
+    // set to "portable"
+    std::unique_ptr<Backend> create();
+
+    // A backend owned by the calling thread, created on first use
+    Backend& local();
+}
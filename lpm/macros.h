@@ -6,6 +6,9 @@
 #define LPM_DEFAULT_LOCAL_MODULES_PATH "lpm_modules/${module_name}"
 #define LPM_DEFAULT_LOCAL_MODULES_BIN "lpm_modules/.modules/${binary_name}"
 #define LPM_DEFAULT_LOCAL_MODULES_INTEGRITY "lpm_modules/.modules/module_integrity.toml"
+#define LPM_DEFAULT_LOCAL_MODULES_INDEX "lpm_modules/.modules/module_index.toml"
+#define LPM_MODULES_MAP_NAME "module_map.lua"
+#define LPM_MODULES_LOADER_NAME "loader.lua"
 
 #ifndef LPM_SHOULD_PRINT_ERRORS
     #define LPM_SHOULD_PRINT_ERRORS 1
@@ -68,4 +71,58 @@
 
 // Specific macros
 
-#define LPM_ZIP_BUFFER_SIZE 1024
\ No newline at end of file
+#define LPM_ZIP_BUFFER_SIZE 1024
+#define LPM_BUNDLE_FORMAT_VERSION 1
+#define LPM_BUNDLE_ALIGNMENT 4096
+
+// Directory under packages_cache holding precompiled bytecode, one
+// subdirectory per Lua version
+#define LPM_BYTECODE_CACHE_NAME "bytecode"
+
+// Directory under packages_cache holding built native modules, one
+// subdirectory per Lua version
+#define LPM_BUILD_CACHE_NAME "build"
+
+// Download window changes kept for Stats::window_changes
+#define LPM_STATS_MAX_WINDOW_CHANGES 256
+
+// A batch of file writes is flushed once it holds this many files or
+// this many bytes of its own
+#define LPM_IO_BATCH_FILES 1024
+#define LPM_IO_BATCH_BYTES (16 * 1024 * 1024)
+
+// Submission queue size of the io_uring backend, and how many files it
+// keeps open at once
+#define LPM_IO_URING_ENTRIES 256
+#define LPM_IO_URING_FILES 64
+
+// Stored archive entries up to this size are written through the I/O
+// batch, larger ones are copied by the kernel
+#define LPM_IO_SMALL_FILE (64 * 1024)
+
+// Network state kept between runs, in packages_cache. Hidden so the
+// cache collector leaves it alone.
+#define LPM_NETWORK_CACHE_DIR ".network"
+#define LPM_NETWORK_STATE_NAME "state.toml"
+#define LPM_NETWORK_ALTSVC_NAME "alt-svc.txt"
+#define LPM_NETWORK_HSTS_NAME "hsts.txt"
+#define LPM_NETWORK_LOCK_NAME ".lock"
+
+// getaddrinfo doesn't tell record TTLs, persisted answers are trusted
+// for this long (and dropped early if connecting to them fails)
+#define LPM_NETWORK_DNS_TTL 300
+
+// Search index file, stored in repositories_cache
+#define LPM_SEARCH_INDEX_NAME "search_index.bin"
+
+// Size of each block of interned strings in a catalog
+#define LPM_CATALOG_ARENA_BLOCK_SIZE 65536
+
+// Bookkeeping of the cache collector, inside each cache directory
+#define LPM_CACHE_ACCESS_DIR ".access"
+#define LPM_CACHE_TRASH_DIR ".trash"
+#define LPM_CACHE_LOCK_NAME ".gc.lock"
+
+// Entries used more recently than this are never evicted, so an
+// install in progress never loses its archive
+#define LPM_CACHE_GRACE_SECONDS 600
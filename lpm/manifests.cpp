@@ -1,29 +1,147 @@
+#include <charconv>
 #include "manifests.h"
 #include "macros.h"
+#include "schema.h"
+#include "utils.h"
 #include "toml11/toml.hpp"
 
-void LPM::Manifests::Packages::load() {
-    std::ifstream file(this->path);
+namespace {
+    // Whether value is a whole integer, as written back for 'priority'
+    bool parse_priority(const std::string& value, std::int64_t& priority) {
+        const char* end = value.data() + value.size();
+        auto result = std::from_chars(value.data(), end, priority);
 
-    if (!file.is_open()) {
+        return result.ec == std::errc() && result.ptr == end;
+    }
+
+    void parse_packages(LPM::Manifests::Packages& packages) {
+        toml::value data = toml::parse(packages.path);
+        packages.name = toml::find_or(data, "project", "name", "");
+        packages.version = toml::find_or(data, "project", "version", "");
+        packages.description = toml::find_or(data, "project", "description", "");
+        packages.author = toml::find_or(data, "project", "author", "");
+        packages.license = toml::find_or(data, "project", "license", "");
+        packages.homepage = toml::find_or(data, "project", "homepage", "");
+        packages.repository = toml::find_or(data, "project", "repository", "");
+        packages.main = toml::find_or(data, "project", "main", "");
+        packages.lua_version = toml::find_or(data, "project", "lua_version", "");
+
+        if (data.contains("dependencies")) {
+            packages.dependencies = toml::find<
+                std::map<std::string, std::string>
+            >(data, "dependencies");
+        }
+    }
+
+    void check_lpm(const LPM::Manifests::Config& config) {
+        std::string missing_keys = "";
+
+        if (config.db_backend == "") {
+            missing_keys += " db_backend";
+        }
+
+        if (config.packages_db == "") {
+            missing_keys += " packages_db";
+        }
+
+        if (config.repositories_cache == "") {
+            missing_keys += " repositories_cache";
+        }
+
+        if (config.packages_cache == "") {
+            missing_keys += " packages_cache";
+        }
+
+        if (config.modules_path == "") {
+            missing_keys += " modules_path";
+        }
+
+        if (missing_keys != "") {
+            throw std::runtime_error(
+                "Your 'lpm' section in your lpm.toml configuration file is missing the following parameters:" + missing_keys
+            );
+        }
+
+        if (config.cache_max_size_mb < 0 || config.cache_max_age_days < 0) {
+            throw std::runtime_error("The 'cache' limits in your lpm.toml configuration file can't be negative");
+        }
+    }
+
+    void check_luas(const LPM::Manifests::Config& config, bool has_luas) {
+        if (!has_luas) {
+            throw std::runtime_error("No Lua interpreters specified in the lpm.toml file. Specify them using the 'luas' section");
+        }
+
+        if (!config.luas.contains("default")) {
+            throw std::runtime_error("You must specify a 'default' Lua interpreter in your lpm.toml file, under 'luas' section.");
+        }
+    }
+
+    void check_sources(bool has_sources) {
+        if (!has_sources) {
+            throw std::runtime_error("No repositories specified in the lpm.toml file.");
+        }
+    }
+
+    // Checks run as each part is read, so errors come out in the same
+    // order as with the fast path
+    void parse_config(LPM::Manifests::Config& config) {
+        toml::value data = toml::parse(config.path);
+        config.db_backend = toml::find_or(data, "lpm", "db_backend", "");
+        config.packages_db = toml::find_or(data, "lpm", "packages_db", "");
+        config.repositories_cache = toml::find_or(data, "lpm", "repositories_cache", "");
+        config.packages_cache = toml::find_or(data, "lpm", "packages_cache", "");
+        config.modules_path = toml::find_or(data, "lpm", "modules_path", "");
+        config.cache_max_size_mb = toml::find_or(data, "cache", "max_size_mb", std::int64_t(0));
+        config.cache_max_age_days = toml::find_or(data, "cache", "max_age_days", std::int64_t(0));
+
+        check_lpm(config);
+
+        if (data.contains("luas")) {
+            config.luas = toml::find<
+                std::map<std::string, std::string>
+            >(data, "luas");
+        }
+
+        check_luas(config, data.contains("luas"));
+
+        if (data.contains("lua_includes")) {
+            config.lua_includes = toml::find<
+                std::map<std::string, std::string>
+            >(data, "lua_includes");
+        }
+
+        if (data.contains("sources")) {
+            // Strings, except 'priority' which may be an integer, as the
+            // fast path reads it
+            for (auto& source : toml::find(data, "sources").as_table()) {
+                auto& repository = config.repositories[source.first];
+
+                for (auto& entry : source.second.as_table()) {
+                    if (entry.first == "priority" && entry.second.is_integer()) {
+                        repository.emplace(entry.first, std::to_string(entry.second.as_integer()));
+                    } else {
+                        repository.emplace(entry.first, entry.second.as_string());
+                    }
+                }
+            }
+        }
+
+        check_sources(data.contains("sources"));
+    }
+}
+
+void LPM::Manifests::Packages::load(bool use_schema) {
+    Utils::MappedFile file;
+    std::string error;
+
+    if (!file.open(this->path, error)) {
         throw std::runtime_error("Failed to open package manifest file: " + this->path);
     }
 
-    toml::value data = toml::parse(this->path);
-    this->name = toml::find_or(data, "project", "name", "");
-    this->version = toml::find_or(data, "project", "version", "");
-    this->description = toml::find_or(data, "project", "description", "");
-    this->author = toml::find_or(data, "project", "author", "");
-    this->license = toml::find_or(data, "project", "license", "");
-    this->homepage = toml::find_or(data, "project", "homepage", "");
-    this->repository = toml::find_or(data, "project", "repository", "");
-    this->main = toml::find_or(data, "project", "main", "");
-    this->lua_version = toml::find_or(data, "project", "lua_version", "");
-
-    if (data.contains("dependencies")) {
-        this->dependencies = toml::find<
-            std::map<std::string, std::string>
-        >(data, "dependencies");
+    if (!use_schema || !Schema::packages(file.data(), file.size(), *this)) {
+        LPM_PRINT_DEBUG("Parsing " << this->path << " with toml11");
+        parse_packages(*this);
     }
 
     LPM_PRINT_DEBUG("Loaded data for project: " << this->name);
@@ -76,69 +194,22 @@ void LPM::Manifests::Packages::save() {
     }
 }
 
-void LPM::Manifests::Config::load() {
-    std::ifstream file(this->path);
+void LPM::Manifests::Config::load(bool use_schema) {
+    Utils::MappedFile file;
+    std::string error;
 
-    if (!file.is_open()) {
+    if (!file.open(this->path, error)) {
         throw std::runtime_error("Failed to open config file: " + this->path);
     }
 
-    toml::value data = toml::parse(this->path);
-    this->db_backend = toml::find_or(data, "lpm", "db_backend", "");
-    this->packages_db = toml::find_or(data, "lpm", "packages_db", "");
-    this->repositories_cache = toml::find_or(data, "lpm", "repositories_cache", "");
-    this->packages_cache = toml::find_or(data, "lpm", "packages_cache", "");
-    this->modules_path = toml::find_or(data, "lpm", "modules_path", "");
-
-    std::string missing_keys = "";
-
-    if (this->db_backend == "") {
-        missing_keys += " db_backend";
-    }
-
-    if (this->packages_db == "") {
-        missing_keys += " packages_db";
-    }
-
-    if (this->repositories_cache == "") {
-        missing_keys += " repositories_cache";
-    }
-
-    if (this->packages_cache == "") {
-        missing_keys += " packages_cache";
-    }
-
-    if (this->modules_path == "") {
-        missing_keys += " modules_path";
-    }
-
-    if (missing_keys != "") {
-        throw std::runtime_error(
-            "Your 'lpm' section in your lpm.toml configuration file is missing the following parameters:" + missing_keys
-        );
-    }
-
-    if (data.contains("luas")) {
-        this->luas = toml::find<
-            std::map<std::string, std::string>
-        >(data, "luas");
-
-        if (!this->luas.contains("default")) {
-            throw std::runtime_error("You must specify a 'default' Lua interpreter in your lpm.toml file, under 'luas' section.");
-        }
+    bool has_luas = false, has_sources = false;
+    if (use_schema && Schema::config(file.data(), file.size(), *this, has_luas, has_sources)) {
+        check_lpm(*this);
+        check_luas(*this, has_luas);
+        check_sources(has_sources);
     } else {
-        throw std::runtime_error("No Lua interpreters specified in the lpm.toml file. Specify them using the 'luas' section");
-    }
-
-    if (data.contains("sources")) {
-        this->repositories = toml::find<
-            std::map<
-                std::string,
-                std::map<std::string, std::string>
-            >
-        >(data, "sources");
-    } else {
-        throw std::runtime_error("No repositories specified in the lpm.toml file.");
+        LPM_PRINT_DEBUG("Parsing " << this->path << " with toml11");
+        parse_config(*this);
     }
 
     LPM_PRINT_DEBUG("Loaded data for config: " << this->path);
@@ -146,6 +217,8 @@ void LPM::Manifests::Config::load() {
     // print all of the parsed data
     LPM_PRINT_DEBUG("this->db_backend : " << this->db_backend);
     LPM_PRINT_DEBUG("this->packages_db : " << this->packages_db);
+    LPM_PRINT_DEBUG("this->cache_max_size_mb : " << this->cache_max_size_mb);
+    LPM_PRINT_DEBUG("this->cache_max_age_days : " << this->cache_max_age_days);
     LPM_PRINT_DEBUG("this->luas.size() : " << this->luas.size());
     for (auto& lua : this->luas) {
         LPM_PRINT_DEBUG("this->luas : " << lua.first << " " << lua.second);
@@ -176,16 +249,35 @@ void LPM::Manifests::Config::save() {
         {"modules_path", this->modules_path}
     };
 
+    if (this->cache_max_size_mb > 0 || this->cache_max_age_days > 0) {
+        data["cache"] = toml::value {
+            {"max_size_mb", this->cache_max_size_mb},
+            {"max_age_days", this->cache_max_age_days}
+        };
+    }
+
     data["luas"] = toml::value{};
     for (auto& lua : this->luas) {
         data["luas"][lua.first] = lua.second;
     }
 
+    if (!this->lua_includes.empty()) {
+        data["lua_includes"] = toml::value{};
+        for (auto& include : this->lua_includes) {
+            data["lua_includes"][include.first] = include.second;
+        }
+    }
+
     data["sources"] = toml::value{};
     for (auto& repository : this->repositories) {
         data["sources"][repository.first] = toml::value{};
         for (auto& source : repository.second) {
-            data["sources"][repository.first][source.first] = source.second;
+            std::int64_t priority;
+            if (source.first == "priority" && parse_priority(source.second, priority)) {
+                data["sources"][repository.first][source.first] = priority;
+            } else {
+                data["sources"][repository.first][source.first] = source.second;
+            }
         }
     }
 
@@ -224,7 +316,7 @@ void LPM::Manifests::Repository::load() {
                     package.first,
                     toml::find_or(package.second, "summary", ""),
                     toml::find_or(package.second, "package_type", ""),
-                    versions
+                    std::move(versions)
                 }
             );
         }
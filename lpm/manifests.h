@@ -1,14 +1,19 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
+#include <utility>
 
 namespace LPM::Manifests {
+    // Manifests are parsed with Schema's single pass parser, falling back
+    // to toml11 for anything it doesn't handle. With use_schema false
+    // only toml11 is used, to check the fast path against it.
     class Packages {
     public:
-        Packages(const std::string& path) {
+        Packages(const std::string& path, bool use_schema = true) {
             this->path = path;
-            this->load();
+            this->load(use_schema);
         }
 
         std::string
@@ -19,15 +24,15 @@ namespace LPM::Manifests {
 
         std::map<std::string, std::string> dependencies;
 
-        void load();
+        void load(bool use_schema = true);
         void save();
     };
 
     class Config {
     public:
-        Config(const std::string& path) {
+        Config(const std::string& path, bool use_schema = true) {
             this->path = path;
-            this->load();
+            this->load(use_schema);
         }
 
         std::string
@@ -35,13 +40,22 @@ namespace LPM::Manifests {
             repositories_cache, packages_cache,
             modules_path;
 
+        // Budget for packages_cache and repositories_cache together, from
+        // the optional 'cache' section. 0 means unlimited.
+        std::int64_t cache_max_size_mb = 0, cache_max_age_days = 0;
+
         std::map<std::string, std::string> luas;
+
+        // Header directories of the interpreters in luas, from the
+        // optional 'lua_includes' section, for building native modules
+        std::map<std::string, std::string> lua_includes;
+
         std::map<
             std::string,
             std::map<std::string, std::string>
         > repositories;
 
-        void load();
+        void load(bool use_schema = true);
         void save();
     };
 
@@ -55,10 +69,10 @@ namespace LPM::Manifests {
                 std::string _summary,
                 std::string _package_type,
                 std::map<std::string, std::string> _versions
-            ) : name(_name),
-                summary(_summary),
-                package_type(_package_type),
-                versions(_versions) {}
+            ) : name(std::move(_name)),
+                summary(std::move(_summary)),
+                package_type(std::move(_package_type)),
+                versions(std::move(_versions)) {}
 
             std::string name, summary, package_type;
             std::map<std::string, std::string> versions;
@@ -0,0 +1,308 @@
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include "modules.h"
+#include "macros.h"
+#include "utils.h"
+#include "toml11/toml.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+    // Installed as the second searcher, right after package.preload, so
+    // mapped modules never reach the package.path probing. Anything not
+    // in the map falls through to the regular searchers.
+    const char* LOADER_TEMPLATE = R"lua(-- Generated by lpm, do not edit
+local map = dofile(${map_path})
+local searchers = package.searchers or package.loaders
+
+local function searcher(name)
+    local file = map[name]
+    if not file then
+        return "\n\tno field lpm module map['" .. name .. "']"
+    end
+
+    -- { source, bytecode }: lpm checked the bytecode against the source
+    -- when it wrote the map. Bytecode built for another interpreter
+    -- fails to load, in which case we fall back to the source.
+    if type(file) == "table" then
+        local chunk = loadfile(file[2], "b")
+        if chunk then
+            return chunk, file[1]
+        end
+        file = file[1]
+    end
+
+    if file:sub(-4) == ".lua" then
+        local chunk, err = loadfile(file)
+        if not chunk then
+            error("error loading module '" .. name .. "' from file '" .. file .. "':\n\t" .. err, 2)
+        end
+        return chunk, file
+    end
+
+    local symbol = "luaopen_" .. (name:gsub("^[^-]*-", ""):gsub("%.", "_"))
+    local chunk, err = package.loadlib(file, symbol)
+    if not chunk then
+        error("error loading module '" .. name .. "' from file '" .. file .. "':\n\t" .. err, 2)
+    end
+    return chunk, file
+end
+
+table.insert(searchers, 2, searcher)
+
+return map
+)lua";
+}
+
+LPM::Modules::Index::Index(const std::string& path) {
+    this->path = path;
+
+    fs::path directory = fs::path(path).parent_path();
+    this->map_path = (directory / LPM_MODULES_MAP_NAME).string();
+    this->loader_path = (directory / LPM_MODULES_LOADER_NAME).string();
+
+    this->load();
+}
+
+bool LPM::Modules::module_names(
+    const std::string& relative_path,
+    std::string& name,
+    std::string& alias
+) {
+    fs::path file(relative_path);
+    std::string extension = file.extension().string();
+
+    bool is_lua = extension == ".lua";
+    bool is_native = extension == ".so" || extension == ".dll";
+
+    if (!is_lua && !is_native) {
+        return false;
+    }
+
+    name.clear();
+    alias.clear();
+
+    fs::path stem = file;
+    stem.replace_extension();
+
+    for (auto& segment : stem) {
+        std::string part = segment.string();
+
+        // Neither hidden directories nor dotted segments can be
+        // reached through require
+        if (part.empty() || part[0] == '.' || part.find('.') != std::string::npos) {
+            return false;
+        }
+
+        if (!name.empty()) {
+            name += '.';
+        }
+
+        name += part;
+    }
+
+    if (name.empty()) {
+        return false;
+    }
+
+    // foo/init.lua is found both as foo (?/init.lua) and foo.init (?.lua),
+    // and so is a native foo/init.so built for a source package
+    if (file.stem() == "init" && file.has_parent_path()) {
+        alias = name;
+        name.erase(name.size() - std::string(".init").size());
+    }
+
+    return true;
+}
+
+void LPM::Modules::Index::add(
+    const std::string& package_name,
+    const std::string& package_path
+) {
+    auto& modules = this->packages[package_name];
+    for (auto& module : modules) {
+        this->bytecode.erase(module.second);
+    }
+    modules.clear();
+
+    fs::path root = fs::absolute(package_path).lexically_normal();
+    if (!root.has_filename()) {
+        root = root.parent_path();
+    }
+
+    if (!fs::is_directory(root)) {
+        LPM_PRINT_DEBUG("No installed files for " << package_name << " at " << root);
+
+        return;
+    }
+
+    // Module names are relative to the directory holding every package
+    fs::path base = root.parent_path();
+    std::string name, alias;
+
+    for (
+        auto& entry : fs::recursive_directory_iterator(
+            root, fs::directory_options::skip_permission_denied
+        )
+    ) {
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+
+        std::string relative = entry.path().lexically_relative(base).generic_string();
+        if (!module_names(relative, name, alias)) {
+            continue;
+        }
+
+        std::string file = entry.path().string();
+        modules.emplace(name, file);
+        if (!alias.empty()) {
+            modules.emplace(alias, file);
+        }
+    }
+
+    LPM_PRINT_DEBUG("Indexed " << modules.size() << " modules for " << package_name);
+}
+
+void LPM::Modules::Index::remove(const std::string& package_name) {
+    auto package = this->packages.find(package_name);
+    if (package == this->packages.end()) {
+        return;
+    }
+
+    for (auto& module : package->second) {
+        this->bytecode.erase(module.second);
+    }
+
+    this->packages.erase(package);
+}
+
+std::map<std::string, std::string> LPM::Modules::Index::modules() const {
+    std::map<std::string, std::string> result;
+
+    for (auto& package : this->packages) {
+        for (auto& module : package.second) {
+            if (!result.emplace(module.first, module.second).second) {
+                LPM_PRINT_DEBUG(
+                    "Module " << module.first << " from " << package.first <<
+                    " is shadowed by " << result[module.first]
+                );
+            }
+        }
+    }
+
+    return result;
+}
+
+void LPM::Modules::Index::load() {
+    this->packages.clear();
+    this->bytecode.clear();
+
+    // A missing index only means nothing has been installed yet
+    if (!fs::exists(this->path)) {
+        return;
+    }
+
+    toml::value data = toml::parse(this->path);
+
+    if (data.contains("packages")) {
+        this->packages = toml::find<
+            std::map<
+                std::string,
+                std::map<std::string, std::string>
+            >
+        >(data, "packages");
+    }
+
+    if (data.contains("bytecode")) {
+        this->bytecode = toml::find<
+            std::map<
+                std::string,
+                std::map<std::string, std::string>
+            >
+        >(data, "bytecode");
+    }
+
+    LPM_PRINT_DEBUG("Loaded module index: " << this->path);
+    LPM_PRINT_DEBUG("this->packages.size() : " << this->packages.size());
+    LPM_PRINT_DEBUG("this->bytecode.size() : " << this->bytecode.size());
+}
+
+void LPM::Modules::Index::save() {
+    // The searcher loads bytecode without looking at the source, so drop
+    // whatever no longer matches it (a source edited in place, bytecode
+    // evicted from the cache) before it goes into the map
+    for (auto compiled = this->bytecode.begin(); compiled != this->bytecode.end();) {
+        Utils::MappedFile source;
+        std::string error;
+        auto hash = compiled->second.find("hash");
+        auto file = compiled->second.find("file");
+
+        bool current =
+            hash != compiled->second.end() && file != compiled->second.end() &&
+            fs::exists(file->second) && source.open(compiled->first, error) &&
+            Utils::to_hex(Utils::hash(source.data(), source.size())) == hash->second;
+
+        if (current) {
+            ++compiled;
+        } else {
+            LPM_PRINT_DEBUG("Dropping stale bytecode of " << compiled->first);
+            compiled = this->bytecode.erase(compiled);
+        }
+    }
+
+    toml::value data;
+
+    data["packages"] = toml::value{};
+    for (auto& package : this->packages) {
+        data["packages"][package.first] = toml::value{};
+        for (auto& module : package.second) {
+            data["packages"][package.first][module.first] = module.second;
+        }
+    }
+
+    data["bytecode"] = toml::value{};
+    for (auto& compiled : this->bytecode) {
+        data["bytecode"][compiled.first] = toml::value{};
+        for (auto& field : compiled.second) {
+            data["bytecode"][compiled.first][field.first] = field.second;
+        }
+    }
+
+    std::stringstream index;
+    index << data;
+
+    if (!Utils::replace_file(this->path, index.str())) {
+        throw std::runtime_error("Failed to write to file: " + this->path);
+    }
+
+    std::string map = "-- Generated by lpm, do not edit\nreturn {\n";
+    for (auto& module : this->modules()) {
+        map += "    [" + Utils::quote_lua(module.first) + "] = ";
+
+        auto compiled = this->bytecode.find(module.second);
+        if (compiled != this->bytecode.end()) {
+            map += "{ " + Utils::quote_lua(module.second) + ", " +
+                Utils::quote_lua(compiled->second.at("file")) + " },\n";
+        } else {
+            map += Utils::quote_lua(module.second) + ",\n";
+        }
+    }
+    map += "}\n";
+
+    if (!Utils::replace_file(this->map_path, map)) {
+        throw std::runtime_error("Failed to write to file: " + this->map_path);
+    }
+
+    std::string loader = LOADER_TEMPLATE;
+    Utils::format(loader, {
+        { "map_path", Utils::quote_lua(fs::absolute(this->map_path).string()) }
+    });
+
+    if (!Utils::replace_file(this->loader_path, loader)) {
+        throw std::runtime_error("Failed to write to file: " + this->loader_path);
+    }
+
+    LPM_PRINT_DEBUG("Saved module index: " << this->path);
+}
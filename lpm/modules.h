@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <map>
+
+namespace LPM::Modules {
+    // Maps every installed Lua module to the file that provides it, so
+    // `require` can be resolved with a single table lookup instead of
+    // probing each package.path template.
+    //
+    // The index lives in the .modules directory next to the installed
+    // packages. Next to it we generate:
+    //   module_map.lua  returns a { [module name] = absolute file } table
+    //   loader.lua      installs a searcher that resolves through the map,
+    //                   preferring precompiled bytecode when there is some
+    class Index {
+    public:
+        Index(const std::string& path);
+
+        std::string path, map_path, loader_path;
+
+        // package name -> (module name -> absolute file)
+        std::map<
+            std::string,
+            std::map<std::string, std::string>
+        > packages;
+
+        // source file -> { hash, file } of its precompiled bytecode.
+        // Entries are dropped whenever their package is rescanned, and
+        // save() drops those whose source changed since (edited in place)
+        // or whose bytecode is gone, so the loader can trust the rest.
+        std::map<
+            std::string,
+            std::map<std::string, std::string>
+        > bytecode;
+
+        // (Re)scan a single installed package, leaving the others untouched
+        void add(const std::string& package_name, const std::string& package_path);
+        void remove(const std::string& package_name);
+
+        // Every module of every package, first package (by name) wins
+        std::map<std::string, std::string> modules() const;
+
+        void load();
+
+        // Write the index, the map and the loader, each to a temp file
+        // renamed into place, so a running application never reads a
+        // truncated map. Rewrites everything: call it once after a batch
+        // of add() and remove(), not after each.
+        void save();
+    };
+
+    // Turn a file path relative to the modules directory into the names
+    // `require` would find it under (foo/bar.lua -> foo.bar,
+    // foo/init.lua -> foo and foo.init). Returns false for non-module files.
+    bool module_names(
+        const std::string& relative_path,
+        std::string& name,
+        std::string& alias
+    );
+}
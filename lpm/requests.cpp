@@ -1,5 +1,520 @@
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <vector>
 #include "requests.h"
 #include "macros.h"
+#include "stats.h"
+#include "utils.h"
+#include "toml11/toml.hpp"
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/file.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+    // A DNS answer, handed back to curl through CURLOPT_RESOLVE
+    struct Pin {
+        std::string address;
+        std::int64_t expires = 0;
+
+        // Read from an earlier run, rather than resolved by this one
+        bool persisted = false;
+    };
+
+    // A TLS session as exported by curl, keyed by a salted hash of the
+    // peer it belongs to
+    struct Ticket {
+        std::string data;
+        std::int64_t expires = 0;
+    };
+
+    struct Network {
+        std::mutex mutex;
+
+        // DNS answers and TLS sessions shared by every handle
+        CURLSH* share = nullptr;
+        std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+        // Where the state is persisted, empty unless persist() was called
+        std::string directory;
+        bool pin_addresses = true;
+
+        // This process's copies of the alt-svc and HSTS files in
+        // directory. curl rewrites them when a handle is cleaned up,
+        // save() merges them back under the lock.
+        std::string altsvc_path, hsts_path;
+
+        // By "host:port", and by hex of the peer hash
+        std::map<std::string, Pin> pins;
+        std::map<std::string, Ticket> tickets;
+
+        // Persisted pins that failed to connect, not saved back
+        std::set<std::string> forgotten;
+
+        // CURLOPT_RESOLVE list for new handles. curl only reads it when a
+        // handle starts its first transfer, replaced lists live until exit.
+        curl_slist* resolve = nullptr;
+        std::vector<curl_slist*> lists;
+
+        ~Network() {
+            for (auto list : lists) {
+                curl_slist_free_all(list);
+            }
+
+            if (share) {
+                curl_share_cleanup(share);
+            }
+        }
+    };
+
+    Network& network() {
+        static Network state;
+        return state;
+    }
+
+    void lock_share(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        static_cast<Network*>(userptr)->share_locks[data].lock();
+    }
+
+    void unlock_share(CURL*, curl_lock_data data, void* userptr) {
+        static_cast<Network*>(userptr)->share_locks[data].unlock();
+    }
+
+    // Created on first use, with state.mutex held
+    CURLSH* share(Network& state) {
+        if (!state.share) {
+            state.share = curl_share_init();
+
+            if (state.share) {
+                curl_share_setopt(state.share, CURLSHOPT_LOCKFUNC, lock_share);
+                curl_share_setopt(state.share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+                curl_share_setopt(state.share, CURLSHOPT_USERDATA, &state);
+                curl_share_setopt(state.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(state.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            }
+        }
+
+        return state.share;
+    }
+
+    std::int64_t now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    // "host:port" a url connects to, empty when there is nothing to
+    // resolve (an IP literal) or the port isn't known
+    std::string peer(const std::string& url) {
+        size_t scheme_end = url.find("://");
+        std::string scheme = scheme_end == std::string::npos ? "" : url.substr(0, scheme_end);
+        size_t start = scheme_end == std::string::npos ? 0 : scheme_end + 3;
+
+        size_t end = url.find_first_of("/?#", start);
+        std::string authority = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+        size_t at = authority.rfind('@');
+        if (at != std::string::npos) {
+            authority.erase(0, at + 1);
+        }
+
+        if (authority.empty() || authority[0] == '[') {
+            return "";
+        }
+
+        for (auto& c : authority) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+
+        size_t colon = authority.find(':');
+        std::string host = authority.substr(0, colon);
+        std::string port = colon == std::string::npos ? "" : authority.substr(colon + 1);
+
+        if (port.empty()) {
+            for (auto& c : scheme) {
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+
+            port = scheme == "https" ? "443" : scheme == "http" ? "80" : "";
+        }
+
+        if (
+            port.empty() ||
+            host.find_first_not_of("0123456789.") == std::string::npos
+        ) {
+            return "";
+        }
+
+        return host + ":" + port;
+    }
+
+    std::string encode(const unsigned char* data, size_t size) {
+        static const char* digits = "0123456789abcdef";
+
+        std::string result;
+        result.reserve(size * 2);
+        for (size_t i = 0; i < size; i++) {
+            result += digits[data[i] >> 4];
+            result += digits[data[i] & 15];
+        }
+
+        return result;
+    }
+
+    std::string decode(const std::string& hex) {
+        auto value = [](char c) {
+            return c <= '9' ? c - '0' : std::tolower(static_cast<unsigned char>(c)) - 'a' + 10;
+        };
+
+        std::string result(hex.size() / 2, '\0');
+        for (size_t i = 0; i < result.size(); i++) {
+            result[i] = static_cast<char>(value(hex[2 * i]) << 4 | value(hex[2 * i + 1]));
+        }
+
+        return result;
+    }
+
+    // Pins are useless (and misleading) when a proxy does the resolving
+    bool behind_proxy() {
+        for (auto name : { "http_proxy", "https_proxy", "HTTPS_PROXY", "all_proxy", "ALL_PROXY" }) {
+            const char* value = std::getenv(name);
+            if (value && *value) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // With state.mutex held
+    void rebuild_resolve(Network& state) {
+        curl_slist* list = nullptr;
+        for (auto& pin : state.pins) {
+            const std::string& address = pin.second.address;
+            list = curl_slist_append(
+                list,
+                (
+                    pin.first + ":" +
+                    (address.find(':') == std::string::npos ? address : "[" + address + "]")
+                ).c_str()
+            );
+        }
+
+        if (list) {
+            state.lists.push_back(list);
+        }
+
+        state.resolve = list;
+    }
+
+    // Serializes updates of the state file between processes. The file
+    // is only ever replaced by a rename, so reading it needs no lock.
+    class StateLock {
+    public:
+        StateLock(const std::string& directory) {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+            std::string path = (fs::path(directory) / LPM_NETWORK_LOCK_NAME).string();
+            descriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (descriptor >= 0) {
+                flock(descriptor, LOCK_EX);
+            }
+#endif
+        }
+
+        ~StateLock() {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+            if (descriptor >= 0) {
+                ::close(descriptor);
+            }
+#endif
+        }
+    private:
+        int descriptor = -1;
+    };
+
+    // Entries of a state file that haven't expired, nothing if it is
+    // missing or unreadable
+    void load(
+        const std::string& path,
+        std::map<std::string, Pin>& pins,
+        std::map<std::string, Ticket>& tickets
+    ) {
+        std::error_code fs_error;
+        if (!fs::exists(path, fs_error)) {
+            return;
+        }
+
+        try {
+            toml::value data = toml::parse(path);
+            std::int64_t time = now();
+
+            if (data.contains("dns")) {
+                auto entries = toml::find<std::map<std::string, toml::value>>(data, "dns");
+                for (auto& entry : entries) {
+                    Pin pin {
+                        toml::find_or(entry.second, "address", ""),
+                        toml::find_or(entry.second, "expires", std::int64_t(0)),
+                        true
+                    };
+
+                    if (!pin.address.empty() && pin.expires > time) {
+                        pins[entry.first] = std::move(pin);
+                    }
+                }
+            }
+
+            if (data.contains("tls")) {
+                auto entries = toml::find<std::map<std::string, toml::value>>(data, "tls");
+                for (auto& entry : entries) {
+                    Ticket ticket {
+                        toml::find_or(entry.second, "session", ""),
+                        toml::find_or(entry.second, "expires", std::int64_t(0))
+                    };
+
+                    if (!ticket.data.empty() && ticket.expires > time) {
+                        tickets[entry.first] = std::move(ticket);
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+            LPM_PRINT_DEBUG("Ignoring unreadable network state " << path << ": " << e.what());
+        }
+    }
+
+    // Replace the state file, readable by the user only: TLS sessions are
+    // as good as the keys they resume
+    bool write(
+        const std::string& path,
+        const std::map<std::string, Pin>& pins,
+        const std::map<std::string, Ticket>& tickets,
+        std::string& error
+    ) {
+        toml::value data;
+        for (auto& pin : pins) {
+            data["dns"][pin.first] = toml::value {
+                {"address", pin.second.address},
+                {"expires", pin.second.expires}
+            };
+        }
+
+        for (auto& ticket : tickets) {
+            data["tls"][ticket.first] = toml::value {
+                {"session", ticket.second.data},
+                {"expires", ticket.second.expires}
+            };
+        }
+
+        std::string temporary_path = LPM::Utils::temporary_path(path);
+        std::error_code fs_error;
+        {
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            fs::permissions(
+                temporary_path,
+                fs::perms::owner_read | fs::perms::owner_write,
+                fs_error
+            );
+
+            if (file.is_open() && !fs_error) {
+                file << data;
+                file.close();
+            }
+
+            if (!file || fs_error) {
+                error = "Failed to write network state to " + temporary_path;
+                fs::remove(temporary_path, fs_error);
+
+                return false;
+            }
+        }
+
+        fs::rename(temporary_path, path, fs_error);
+        if (fs_error) {
+            error = "Failed to replace network state " + path + ": " + fs_error.message();
+            fs::remove(temporary_path, fs_error);
+
+            return false;
+        }
+
+        return true;
+    }
+
+    // Lines of a curl alt-svc or HSTS file by what they are about: the
+    // fields before the quoted expiry, a leading '.' (HSTS for subdomains
+    // too) aside. Later files win.
+    void read_curl_file(const std::string& path, std::map<std::string, std::string>& lines) {
+        std::ifstream file(path);
+        std::string line;
+
+        while (std::getline(file, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+
+            std::string key = line.substr(0, line.find('"'));
+            if (!key.empty() && key[0] == '.') {
+                key.erase(0, 1);
+            }
+
+            lines[key] = line;
+        }
+    }
+
+    // Merge this process's copy of a curl file into the shared one, which
+    // may have been updated by other processes, and drop the copy
+    bool merge_curl_file(const std::string& path, const std::string& copy, std::string& error) {
+        std::error_code fs_error;
+        if (copy.empty() || !fs::exists(copy, fs_error)) {
+            return true;
+        }
+
+        std::map<std::string, std::string> lines;
+        read_curl_file(path, lines);
+        read_curl_file(copy, lines);
+
+        std::string content = "# Merged by lpm from what curl saved\n";
+        for (auto& line : lines) {
+            content += line.second + "\n";
+        }
+
+        if (!LPM::Utils::replace_file(path, content)) {
+            error = "Failed to replace " + path;
+
+            return false;
+        }
+
+        fs::remove(copy, fs_error);
+
+        return true;
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    CURLcode export_ticket(
+        CURL*,
+        void* userptr,
+        const char*,
+        const unsigned char* shmac,
+        size_t shmac_len,
+        const unsigned char* sdata,
+        size_t sdata_len,
+        curl_off_t valid_until,
+        int,
+        const char*,
+        size_t
+    ) {
+        // Without a peer hash the session can't be matched on import
+        if (shmac && shmac_len > 0 && valid_until > 0) {
+            (*static_cast<std::map<std::string, Ticket>*>(userptr))[encode(shmac, shmac_len)] =
+                Ticket { encode(sdata, sdata_len), static_cast<std::int64_t>(valid_until) };
+        }
+
+        return CURLE_OK;
+    }
+#endif
+
+    // Move TLS sessions between state.tickets and the shared session
+    // cache, through a handle attached to it. With state.mutex held.
+    void import_tickets(Network& state) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        CURL* curl_handle = curl_easy_init();
+        if (!curl_handle) {
+            return;
+        }
+
+        curl_easy_setopt(curl_handle, CURLOPT_SHARE, share(state));
+
+        for (auto& ticket : state.tickets) {
+            std::string key = decode(ticket.first), data = decode(ticket.second.data);
+            curl_easy_ssls_import(
+                curl_handle, nullptr,
+                reinterpret_cast<const unsigned char*>(key.data()), key.size(),
+                reinterpret_cast<const unsigned char*>(data.data()), data.size()
+            );
+        }
+
+        curl_easy_cleanup(curl_handle);
+#else
+        state.tickets.clear();
+#endif
+    }
+
+    void export_tickets(Network& state) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        CURL* curl_handle = curl_easy_init();
+        if (!curl_handle) {
+            return;
+        }
+
+        curl_easy_setopt(curl_handle, CURLOPT_SHARE, share(state));
+        curl_easy_ssls_export(curl_handle, export_ticket, &state.tickets);
+        curl_easy_cleanup(curl_handle);
+#else
+        (void)state;
+#endif
+    }
+
+    // Record the address a successful transfer connected to
+    void remember(CURL* curl_handle) {
+        Network& state = network();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.directory.empty() || !state.pin_addresses) {
+            return;
+        }
+
+        char* url = nullptr;
+        char* address = nullptr;
+        curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &url);
+        curl_easy_getinfo(curl_handle, CURLINFO_PRIMARY_IP, &address);
+        if (!url || !address || !*address) {
+            return;
+        }
+
+        std::string key = peer(url);
+        if (!key.empty()) {
+            // A persisted pin keeps its expiry, even while it works, so
+            // moved hosts get resolved again eventually
+            state.pins.try_emplace(key, Pin { address, now() + LPM_NETWORK_DNS_TTL, false });
+        }
+    }
+
+    // Drop the persisted address of a peer that couldn't be reached, so
+    // the next attempt of curl_handle resolves it. False if the failure
+    // had nothing to do with a persisted address.
+    bool forget(CURL* curl_handle) {
+        Network& state = network();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        char* url = nullptr;
+        curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &url);
+        std::string key = url ? peer(url) : "";
+
+        auto pin = state.pins.find(key);
+        if (key.empty() || pin == state.pins.end() || !pin->second.persisted) {
+            return false;
+        }
+
+        LPM_PRINT_DEBUG("Forgetting persisted address " << pin->second.address << " of " << key);
+
+        state.pins.erase(pin);
+        state.forgotten.insert(key);
+        rebuild_resolve(state);
+
+        // Also take it out of the shared DNS cache
+        curl_slist* removal = curl_slist_append(nullptr, ("-" + key).c_str());
+        state.lists.push_back(removal);
+        curl_easy_setopt(curl_handle, CURLOPT_RESOLVE, removal);
+
+        return true;
+    }
+}
 
 // Perform a GET request and return a Response object
 size_t LPM::Requests::write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
@@ -8,16 +523,210 @@ size_t LPM::Requests::write_callback(char *ptr, size_t size, size_t nmemb, void
     return size * nmemb;
 }
 
-LPM::Requests::Response LPM::Requests::get(std::string url, CURL* curl_handle) {
+size_t LPM::Requests::header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    Response* response = static_cast<Response*>(userdata);
+    std::string line(ptr, size * nmemb);
+
+    // A status line starts a new response (after a redirect or a
+    // 100 Continue), only the headers of the last one are kept
+    if (line.rfind("HTTP/", 0) == 0) {
+        response->headers.clear();
+        return size * nmemb;
+    }
+
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+        return size * nmemb;
+    }
+
+    std::string name = line.substr(0, colon);
+    for (auto& c : name) {
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+
+    size_t start = line.find_first_not_of(" \t", colon + 1);
+    size_t end = line.find_last_not_of(" \t\r\n");
+    response->headers[name] =
+        start == std::string::npos || end < start ? "" : line.substr(start, end - start + 1);
+
+    return size * nmemb;
+}
+
+LPM::Requests::Response LPM::Requests::get(
+    const std::string& url,
+    CURL* curl_handle,
+    const std::map<std::string, std::string>& headers
+) {
     Response response;
+    response.url = url;
+    response.status_code = 0;
+
+    curl_slist* header_list = nullptr;
+    for (auto& header : headers) {
+        header_list = curl_slist_append(header_list, (header.first + ": " + header.second).c_str());
+    }
+
     curl_easy_setopt(curl_handle, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, &response);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, header_list);
     curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-    curl_easy_perform(curl_handle);
+    CURLcode result = curl_easy_perform(curl_handle);
+
+    // A persisted address went stale, try again with a real lookup
+    if (result == CURLE_COULDNT_CONNECT && forget(curl_handle)) {
+        response.body.clear();
+        response.headers.clear();
+        result = curl_easy_perform(curl_handle);
+    }
+
+    if (result == CURLE_OK) {
+        remember(curl_handle);
+    }
 
     // Get status code
-    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &response.status_code);
+    long status_code = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &status_code);
+    response.status_code = static_cast<int>(status_code);
+
+    Stats::Counters& counters = Stats::counters();
+    counters.requests++;
+    counters.bytes_downloaded += response.body.size();
+    if (response.status_code == 0 || response.status_code >= 400) {
+        counters.failed_requests++;
+    }
+
+    // The handle may be reused, don't leave it pointing at freed headers
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(header_list);
 
     return response;
-}
\ No newline at end of file
+}
+
+CURL* LPM::Requests::handle() {
+    CURL* curl_handle = curl_easy_init();
+    if (!curl_handle) {
+        return nullptr;
+    }
+
+    Network& state = network();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, share(state));
+
+    if (!state.directory.empty()) {
+        fs::path directory(state.directory);
+
+        if (state.resolve) {
+            curl_easy_setopt(curl_handle, CURLOPT_RESOLVE, state.resolve);
+        }
+
+        // curl loads these files right away and rewrites them when the
+        // handle is cleaned up, outside of any lock: it gets this
+        // process's copies, merged back by save()
+        curl_easy_setopt(curl_handle, CURLOPT_ALTSVC_CTRL, static_cast<long>(CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3));
+        curl_easy_setopt(curl_handle, CURLOPT_ALTSVC, state.altsvc_path.c_str());
+        curl_easy_setopt(curl_handle, CURLOPT_HSTS_CTRL, static_cast<long>(CURLHSTS_ENABLE));
+        curl_easy_setopt(curl_handle, CURLOPT_HSTS, state.hsts_path.c_str());
+    }
+
+    return curl_handle;
+}
+
+bool LPM::Requests::persist(const std::string& directory, std::string& error) {
+    std::error_code fs_error;
+    fs::create_directories(directory, fs_error);
+    if (fs_error) {
+        error = "Failed to create network state directory " + directory + ": " + fs_error.message();
+
+        return false;
+    }
+
+    Network& state = network();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    state.directory = directory;
+    state.pin_addresses = !behind_proxy();
+    state.pins.clear();
+    state.tickets.clear();
+
+    load((fs::path(directory) / LPM_NETWORK_STATE_NAME).string(), state.pins, state.tickets);
+
+    // Start this process's copies from the shared files
+    std::string altsvc_path = (fs::path(directory) / LPM_NETWORK_ALTSVC_NAME).string();
+    std::string hsts_path = (fs::path(directory) / LPM_NETWORK_HSTS_NAME).string();
+    state.altsvc_path = Utils::temporary_path(altsvc_path);
+    state.hsts_path = Utils::temporary_path(hsts_path);
+    {
+        StateLock file_lock(directory);
+
+        for (auto& copy : { std::make_pair(altsvc_path, state.altsvc_path), std::make_pair(hsts_path, state.hsts_path) }) {
+            if (fs::exists(copy.first, fs_error)) {
+                fs::copy_file(copy.first, copy.second, fs::copy_options::overwrite_existing, fs_error);
+            }
+        }
+    }
+
+    if (!state.pin_addresses) {
+        state.pins.clear();
+    }
+
+    rebuild_resolve(state);
+    import_tickets(state);
+
+    LPM_PRINT_DEBUG(
+        "Loaded network state from " << directory << ": " <<
+        state.pins.size() << " addresses, " << state.tickets.size() << " TLS sessions"
+    );
+
+    return true;
+}
+
+bool LPM::Requests::save(std::string& error) {
+    Network& state = network();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.directory.empty()) {
+        return true;
+    }
+
+    export_tickets(state);
+
+    std::string path = (fs::path(state.directory) / LPM_NETWORK_STATE_NAME).string();
+    StateLock file_lock(state.directory);
+
+    // Keep what other processes saved since we loaded, ours wins
+    std::map<std::string, Pin> pins;
+    std::map<std::string, Ticket> tickets;
+    load(path, pins, tickets);
+
+    for (auto& key : state.forgotten) {
+        pins.erase(key);
+    }
+
+    for (auto& pin : state.pins) {
+        pins[pin.first] = pin.second;
+    }
+
+    for (auto& ticket : state.tickets) {
+        tickets[ticket.first] = ticket.second;
+    }
+
+    if (!write(path, pins, tickets, error)) {
+        return false;
+    }
+
+    if (
+        !merge_curl_file((fs::path(state.directory) / LPM_NETWORK_ALTSVC_NAME).string(), state.altsvc_path, error) ||
+        !merge_curl_file((fs::path(state.directory) / LPM_NETWORK_HSTS_NAME).string(), state.hsts_path, error)
+    ) {
+        return false;
+    }
+
+    LPM_PRINT_DEBUG(
+        "Saved network state to " << state.directory << ": " <<
+        pins.size() << " addresses, " << tickets.size() << " TLS sessions"
+    );
+
+    return true;
+}
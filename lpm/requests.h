@@ -1,9 +1,12 @@
 #pragma once
 #include <curl/curl.h>
+#include <map>
 #include <string>
+#include <utility>
 
 namespace LPM::Requests {
     size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
 
     class Response {
     public:
@@ -13,13 +16,38 @@ namespace LPM::Requests {
             std::string _body,
             std::string _url,
             int _status_code
-        ) : body(_body),
-            url(_url),
+        ) : body(std::move(_body)),
+            url(std::move(_url)),
             status_code(_status_code) {}
 
         std::string body, url;
         int status_code;
+
+        // Response headers of the final response, names in lowercase
+        std::map<std::string, std::string> headers;
     };
 
-    Response get(std::string url, CURL* curl_handle);
-}
\ No newline at end of file
+    Response get(
+        const std::string& url,
+        CURL* curl_handle,
+        const std::map<std::string, std::string>& headers = {}
+    );
+
+    // A new curl handle (free it with curl_easy_cleanup). DNS answers and
+    // TLS sessions are shared with every other handle of the process, and
+    // seeded from the persisted network state when there is one.
+    CURL* handle();
+
+    // Keep network state across runs in directory: DNS answers (for
+    // LPM_NETWORK_DNS_TTL seconds), TLS session tickets, alt-svc and HSTS.
+    // Loads what earlier runs saved, call it once at startup before
+    // creating handles. A missing or unreadable state only means a cold
+    // start.
+    bool persist(const std::string& directory, std::string& error);
+
+    // Write the network state back, merged with what other processes
+    // saved meanwhile. Does nothing unless persist() was called. Call it
+    // once every handle is cleaned up, since that is when curl writes
+    // the alt-svc and HSTS entries it learned.
+    bool save(std::string& error);
+}
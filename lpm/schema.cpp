@@ -0,0 +1,718 @@
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "schema.h"
+
+using LPM::Manifests::Config;
+using LPM::Manifests::Packages;
+
+namespace {
+    enum class Type { String, Integer, Boolean };
+
+    struct Value {
+        Type type = Type::String;
+
+        // Points into the buffer, or into decoded when there were escapes
+        std::string_view text;
+        std::string decoded;
+
+        std::int64_t integer = 0;
+        bool boolean = false;
+    };
+
+    typedef std::vector<std::string> Path;
+
+    bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    bool is_bare(char c) {
+        return
+            (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            is_digit(c) || c == '_' || c == '-';
+    }
+
+    bool is_control(unsigned char c) {
+        return (c < 0x20 && c != '\t') || c == 0x7f;
+    }
+
+    void append_utf8(std::string& out, std::uint32_t code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xc0 | code >> 6);
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xe0 | code >> 12);
+            out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | code >> 18);
+            out += static_cast<char>(0x80 | (code >> 12 & 0x3f));
+            out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    }
+
+    // Walks the buffer once, handing every table header and key/value
+    // pair to a visitor as it goes. Returns false on anything outside of
+    // the supported subset, or when the visitor does.
+    class Scanner {
+    public:
+        Scanner(const char* data, size_t size) : p(data), end(data + size) {}
+
+        template <typename Visitor>
+        bool run(Visitor& visitor) {
+            while (p < end) {
+                skip_whitespace();
+                if (p == end) {
+                    break;
+                }
+
+                switch (*p) {
+                    case '#':
+                    case '\r':
+                    case '\n':
+                        if (!end_of_line()) {
+                            return false;
+                        }
+                        break;
+                    case '[':
+                        if (!header() || !visitor.header(table)) {
+                            return false;
+                        }
+                        break;
+                    default:
+                        if (!key_value() || !visitor.key(table, key, value)) {
+                            return false;
+                        }
+                }
+            }
+
+            return true;
+        }
+    private:
+        const char* p;
+        const char* end;
+
+        Path table;
+        std::string key, key_buffer;
+        Value value;
+
+        // Paths joined by '\n' (never part of a key): tables seen, true
+        // once defined by their own header, and keys given a value
+        std::string table_path;
+        std::map<std::string, bool> tables;
+        std::set<std::string> keys;
+
+        void skip_whitespace() {
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+        }
+
+        // Whitespace, an optional comment, then a newline or the end
+        bool end_of_line() {
+            skip_whitespace();
+
+            if (p < end && *p == '#') {
+                p++;
+
+                while (p < end && *p != '\n') {
+                    unsigned char c = static_cast<unsigned char>(*p);
+
+                    if (c == '\r' && p + 1 < end && p[1] == '\n') {
+                        break;
+                    } else if (is_control(c)) {
+                        return false;
+                    } else if (c >= 0x80) {
+                        if (!utf8()) {
+                            return false;
+                        }
+                    } else {
+                        p++;
+                    }
+                }
+            }
+
+            if (p == end) {
+                return true;
+            }
+
+            if (*p == '\n') {
+                p++;
+                return true;
+            }
+
+            if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+                p += 2;
+                return true;
+            }
+
+            return false;
+        }
+
+        // Skip one well-formed UTF-8 sequence
+        bool utf8() {
+            unsigned char lead = static_cast<unsigned char>(*p);
+            size_t length;
+            unsigned char low = 0x80, high = 0xbf;
+
+            if (lead >= 0xc2 && lead <= 0xdf) {
+                length = 2;
+            } else if (lead >= 0xe0 && lead <= 0xef) {
+                length = 3;
+                low = lead == 0xe0 ? 0xa0 : 0x80;
+                high = lead == 0xed ? 0x9f : 0xbf;
+            } else if (lead >= 0xf0 && lead <= 0xf4) {
+                length = 4;
+                low = lead == 0xf0 ? 0x90 : 0x80;
+                high = lead == 0xf4 ? 0x8f : 0xbf;
+            } else {
+                return false;
+            }
+
+            if (static_cast<size_t>(end - p) < length) {
+                return false;
+            }
+
+            for (size_t i = 1; i < length; i++) {
+                unsigned char c = static_cast<unsigned char>(p[i]);
+                if (c < (i == 1 ? low : 0x80) || c > (i == 1 ? high : 0xbf)) {
+                    return false;
+                }
+            }
+
+            p += length;
+            return true;
+        }
+
+        bool escape(std::string& out) {
+            p++;
+            if (p == end) {
+                return false;
+            }
+
+            char kind = *p++;
+            switch (kind) {
+                case 'b': out += '\b'; return true;
+                case 't': out += '\t'; return true;
+                case 'n': out += '\n'; return true;
+                case 'f': out += '\f'; return true;
+                case 'r': out += '\r'; return true;
+                case '"': out += '"'; return true;
+                case '\\': out += '\\'; return true;
+                case 'u':
+                case 'U':
+                    break;
+                default:
+                    return false;
+            }
+
+            size_t digits = kind == 'u' ? 4 : 8;
+            if (static_cast<size_t>(end - p) < digits) {
+                return false;
+            }
+
+            std::uint32_t code = 0;
+            for (size_t i = 0; i < digits; i++, p++) {
+                char c = *p;
+                std::uint32_t digit;
+
+                if (is_digit(c)) {
+                    digit = static_cast<std::uint32_t>(c - '0');
+                } else if (c >= 'a' && c <= 'f') {
+                    digit = static_cast<std::uint32_t>(c - 'a' + 10);
+                } else if (c >= 'A' && c <= 'F') {
+                    digit = static_cast<std::uint32_t>(c - 'A' + 10);
+                } else {
+                    return false;
+                }
+
+                code = code << 4 | digit;
+            }
+
+            if ((code >= 0xd800 && code <= 0xdfff) || code > 0x10ffff) {
+                return false;
+            }
+
+            append_utf8(out, code);
+            return true;
+        }
+
+        // A one-line basic or literal string. view points into the buffer
+        // unless there are escapes to decode into buffer.
+        bool quoted(std::string_view& view, std::string& buffer) {
+            char quote = *p++;
+
+            // Multi-line strings are left to toml11
+            if (end - p >= 2 && p[0] == quote && p[1] == quote) {
+                return false;
+            }
+
+            const char* start = p;
+            bool escaped = false;
+
+            while (true) {
+                if (p == end) {
+                    return false;
+                }
+
+                unsigned char c = static_cast<unsigned char>(*p);
+
+                if (c == static_cast<unsigned char>(quote)) {
+                    break;
+                }
+
+                if (c == '\\' && quote == '"') {
+                    if (!escaped) {
+                        buffer.assign(start, p);
+                        escaped = true;
+                    }
+
+                    if (!escape(buffer)) {
+                        return false;
+                    }
+                } else if (is_control(c)) {
+                    return false;
+                } else if (c >= 0x80) {
+                    const char* sequence = p;
+                    if (!utf8()) {
+                        return false;
+                    }
+
+                    if (escaped) {
+                        buffer.append(sequence, p);
+                    }
+                } else {
+                    if (escaped) {
+                        buffer += static_cast<char>(c);
+                    }
+
+                    p++;
+                }
+            }
+
+            view = escaped ? std::string_view(buffer) : std::string_view(start, p - start);
+            p++;
+
+            return true;
+        }
+
+        bool simple_key(std::string& out) {
+            if (p == end) {
+                return false;
+            }
+
+            if (*p == '"' || *p == '\'') {
+                std::string_view view;
+                if (!quoted(view, key_buffer)) {
+                    return false;
+                }
+
+                out.assign(view);
+                return out.find('\n') == std::string::npos;
+            }
+
+            const char* start = p;
+            while (p < end && is_bare(*p)) {
+                p++;
+            }
+
+            out.assign(start, p);
+            return !out.empty();
+        }
+
+        bool header() {
+            p++;
+
+            // Arrays of tables are left to toml11
+            if (p < end && *p == '[') {
+                return false;
+            }
+
+            table.clear();
+            while (true) {
+                skip_whitespace();
+                table.emplace_back();
+                if (!simple_key(table.back())) {
+                    return false;
+                }
+
+                skip_whitespace();
+                if (p < end && *p == '.') {
+                    p++;
+                    continue;
+                }
+
+                break;
+            }
+
+            if (p == end || *p != ']') {
+                return false;
+            }
+
+            p++;
+            if (!end_of_line()) {
+                return false;
+            }
+
+            // A table is defined once, and can't be (or be inside) a key
+            table_path.clear();
+            for (size_t i = 0; i < table.size(); i++) {
+                if (i > 0) {
+                    table_path += '\n';
+                }
+
+                table_path += table[i];
+                if (keys.contains(table_path)) {
+                    return false;
+                }
+
+                if (i + 1 < table.size()) {
+                    tables.try_emplace(table_path, false);
+                }
+            }
+
+            auto defined = tables.try_emplace(table_path, true);
+            if (!defined.second) {
+                if (defined.first->second) {
+                    return false;
+                }
+
+                defined.first->second = true;
+            }
+
+            return true;
+        }
+
+        bool integer() {
+            bool negative = *p == '-';
+            if (*p == '+' || *p == '-') {
+                p++;
+            }
+
+            if (p == end || !is_digit(*p)) {
+                return false;
+            }
+
+            // Leading zeros aren't allowed, 0x, 0o and 0b are left to toml11
+            if (*p == '0' && p + 1 < end && (is_digit(p[1]) || p[1] == '_')) {
+                return false;
+            }
+
+            std::uint64_t limit = negative ? std::uint64_t(1) << 63 : (std::uint64_t(1) << 63) - 1;
+            std::uint64_t magnitude = 0;
+
+            while (true) {
+                std::uint64_t digit = static_cast<std::uint64_t>(*p - '0');
+                if (magnitude > (limit - digit) / 10) {
+                    return false;
+                }
+
+                magnitude = magnitude * 10 + digit;
+                p++;
+
+                // Underscores only between digits
+                if (p < end && *p == '_') {
+                    p++;
+                    if (p == end || !is_digit(*p)) {
+                        return false;
+                    }
+
+                    continue;
+                }
+
+                if (p == end || !is_digit(*p)) {
+                    break;
+                }
+            }
+
+            value.type = Type::Integer;
+            value.integer = static_cast<std::int64_t>(negative ? 0 - magnitude : magnitude);
+
+            return true;
+        }
+
+        // Whatever follows a value (a '.', ':' or letter of floats, dates
+        // and such) fails end_of_line() afterwards
+        bool parse_value() {
+            if (p == end) {
+                return false;
+            }
+
+            std::string_view rest(p, end - p);
+
+            if (*p == '"' || *p == '\'') {
+                value.type = Type::String;
+                return quoted(value.text, value.decoded);
+            } else if (rest.starts_with("true")) {
+                value.type = Type::Boolean;
+                value.boolean = true;
+                p += 4;
+            } else if (rest.starts_with("false")) {
+                value.type = Type::Boolean;
+                value.boolean = false;
+                p += 5;
+            } else if (is_digit(*p) || *p == '+' || *p == '-') {
+                return integer();
+            } else {
+                return false;
+            }
+
+            return true;
+        }
+
+        bool key_value() {
+            if (!simple_key(key)) {
+                return false;
+            }
+
+            skip_whitespace();
+
+            // Dotted keys define tables implicitly, left to toml11
+            if (p == end || *p != '=') {
+                return false;
+            }
+
+            p++;
+            skip_whitespace();
+
+            if (!parse_value() || !end_of_line()) {
+                return false;
+            }
+
+            std::string path = table_path.empty() ? key : table_path + '\n' + key;
+            if (tables.contains(path)) {
+                return false;
+            }
+
+            return keys.insert(std::move(path)).second;
+        }
+    };
+
+    const std::pair<const char*, std::string Packages::*> PROJECT_FIELDS[] = {
+        { "name", &Packages::name },
+        { "version", &Packages::version },
+        { "description", &Packages::description },
+        { "author", &Packages::author },
+        { "license", &Packages::license },
+        { "homepage", &Packages::homepage },
+        { "repository", &Packages::repository },
+        { "main", &Packages::main },
+        { "lua_version", &Packages::lua_version }
+    };
+
+    const std::pair<const char*, std::string Config::*> LPM_FIELDS[] = {
+        { "db_backend", &Config::db_backend },
+        { "packages_db", &Config::packages_db },
+        { "repositories_cache", &Config::repositories_cache },
+        { "packages_cache", &Config::packages_cache },
+        { "modules_path", &Config::modules_path }
+    };
+
+    const std::pair<const char*, std::int64_t Config::*> CACHE_FIELDS[] = {
+        { "max_size_mb", &Config::cache_max_size_mb },
+        { "max_age_days", &Config::cache_max_age_days }
+    };
+
+    // Set the field named key, if there is one, when value has its type
+    template <typename Object, typename Field, size_t N>
+    bool assign(
+        Object& object,
+        const std::pair<const char*, Field Object::*> (&fields)[N],
+        const std::string& key,
+        const Value& value
+    ) {
+        for (auto& field : fields) {
+            if (key != field.first) {
+                continue;
+            }
+
+            if constexpr (std::is_same_v<Field, std::string>) {
+                if (value.type != Type::String) {
+                    return false;
+                }
+
+                (object.*field.second).assign(value.text);
+            } else {
+                if (value.type != Type::Integer) {
+                    return false;
+                }
+
+                object.*field.second = value.integer;
+            }
+
+            return true;
+        }
+
+        return true;
+    }
+
+    // A string for a map of strings, which toml11 would throw on otherwise
+    bool insert(std::map<std::string, std::string>& map, const std::string& key, const Value& value) {
+        if (value.type != Type::String) {
+            return false;
+        }
+
+        map.emplace(key, value.text);
+        return true;
+    }
+
+    struct PackagesVisitor {
+        Packages& packages;
+
+        bool header(const Path& table) {
+            if (table[0] != "dependencies") {
+                return true;
+            }
+
+            packages.dependencies.clear();
+            return table.size() == 1;
+        }
+
+        bool key(const Path& table, const std::string& key, const Value& value) {
+            if (table.empty()) {
+                return key != "project" && key != "dependencies";
+            }
+
+            if (table.size() > 1) {
+                return true;
+            }
+
+            if (table[0] == "project") {
+                return assign(packages, PROJECT_FIELDS, key, value);
+            }
+
+            if (table[0] == "dependencies") {
+                return insert(packages.dependencies, key, value);
+            }
+
+            return true;
+        }
+    };
+
+    struct ConfigVisitor {
+        Config& config;
+        bool& has_luas;
+        bool& has_sources;
+
+        bool header(const Path& table) {
+            const std::string& section = table[0];
+
+            if (section == "luas") {
+                has_luas = true;
+                config.luas.clear();
+
+                return table.size() == 1;
+            }
+
+            if (section == "lua_includes") {
+                config.lua_includes.clear();
+
+                return table.size() == 1;
+            }
+
+            if (section == "sources") {
+                if (!has_sources) {
+                    config.repositories.clear();
+                    has_sources = true;
+                }
+
+                if (table.size() == 2) {
+                    config.repositories[table[1]];
+                }
+
+                return table.size() <= 2;
+            }
+
+            return true;
+        }
+
+        bool key(const Path& table, const std::string& key, const Value& value) {
+            if (table.empty()) {
+                return
+                    key != "lpm" && key != "cache" && key != "luas" &&
+                    key != "lua_includes" && key != "sources";
+            }
+
+            const std::string& section = table[0];
+
+            if (section == "sources") {
+                if (table.size() != 2) {
+                    return false;
+                }
+
+                auto& repository = config.repositories[table[1]];
+                if (key == "priority" && value.type == Type::Integer) {
+                    repository.emplace(key, std::to_string(value.integer));
+                    return true;
+                }
+
+                return insert(repository, key, value);
+            }
+
+            if (table.size() > 1) {
+                return true;
+            }
+
+            if (section == "lpm") {
+                return assign(config, LPM_FIELDS, key, value);
+            }
+
+            if (section == "cache") {
+                return assign(config, CACHE_FIELDS, key, value);
+            }
+
+            if (section == "luas") {
+                return insert(config.luas, key, value);
+            }
+
+            if (section == "lua_includes") {
+                return insert(config.lua_includes, key, value);
+            }
+
+            return true;
+        }
+    };
+}
+
+bool LPM::Schema::packages(const char* data, size_t size, Manifests::Packages& packages) {
+    // Same defaults as toml::find_or for missing keys
+    for (auto& field : PROJECT_FIELDS) {
+        (packages.*field.second).clear();
+    }
+
+    Scanner scanner(data, size);
+    PackagesVisitor visitor { packages };
+
+    return scanner.run(visitor);
+}
+
+bool LPM::Schema::config(
+    const char* data,
+    size_t size,
+    Manifests::Config& config,
+    bool& has_luas,
+    bool& has_sources
+) {
+    for (auto& field : LPM_FIELDS) {
+        (config.*field.second).clear();
+    }
+
+    for (auto& field : CACHE_FIELDS) {
+        config.*field.second = 0;
+    }
+
+    has_luas = has_sources = false;
+
+    Scanner scanner(data, size);
+    ConfigVisitor visitor { config, has_luas, has_sources };
+
+    return scanner.run(visitor);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include "manifests.h"
+
+namespace LPM::Schema {
+    // Single pass parsers for packages.toml and lpm.toml, filling the
+    // manifest fields straight from the file buffer instead of building a
+    // toml::value tree first.
+    //
+    // Only the TOML lpm writes (and people usually write by hand) is
+    // understood: [tables] and [dotted.tables], plain keys, one-line basic
+    // and literal strings, decimal integers, booleans and comments. Any
+    // other construct, a value of the wrong type for the schema, or a
+    // duplicate key or table returns false, and the caller parses the
+    // file with toml11 instead, which also reports the proper errors.
+    // Fields may be partially filled when false is returned.
+
+    bool packages(const char* data, size_t size, Manifests::Packages& packages);
+
+    // has_luas and has_sources tell whether those sections exist at all,
+    // as opposed to being empty
+    bool config(
+        const char* data,
+        size_t size,
+        Manifests::Config& config,
+        bool& has_luas,
+        bool& has_sources
+    );
+}
@@ -1,31 +1,41 @@
 #pragma once
-#include <memory>
-#include <functional>
+#include <utility>
+#include "macros.h"
 
 namespace LPM {
-    // Call a destructor when something goes out of scope
-    template <class T>
+    // Call a destructor when something goes out of scope. The destructor
+    // is part of the type, so there is nothing to store or call through
+    // besides the object itself:
+    //
+    //   scope_destructor<CURL*, curl_easy_cleanup> handle(curl_easy_init());
+    template <class T, auto Destructor>
     class scope_destructor {
     private:
         T _object;
-        std::function<void(T)> _destructor;
-        bool cancelled;
+        bool cancelled = false;
     public:
-        scope_destructor(T object, std::function<void(T)> destructor)
-        : _object(object), _destructor(destructor) {
+        explicit scope_destructor(T object) : _object(object) {
             LPM_PRINT_DEBUG("scope_destructor initialized for object " << object);
         }
 
+        scope_destructor(const scope_destructor&) = delete;
+        scope_destructor& operator=(const scope_destructor&) = delete;
+
+        scope_destructor(scope_destructor&& other)
+        : _object(std::move(other._object)), cancelled(other.cancelled) {
+            other.cancelled = true;
+        }
+
         ~scope_destructor() {
             if (cancelled) {
                 return;
             }
 
-            _destructor(_object);
+            Destructor(_object);
             LPM_PRINT_DEBUG("scope_destructor called _destructor on " << _object);
         }
 
         T& get() { return _object; }
         void cancel() { cancelled = true; }
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,794 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include "search.h"
+#include "macros.h"
+#include "utils.h"
+
+namespace {
+    // The last byte is the version of the format
+    const char SEARCH_MAGIC[8] = { 'L', 'P', 'M', 'S', 'R', 'C', 'H', '\2' };
+
+    // Counts of documents, nodes and terms, then the total length
+    const size_t HEADER_SIZE = sizeof(SEARCH_MAGIC) + 3 * 4 + 8;
+
+    // Entries of the tables that follow the header
+    const size_t DOCUMENT_SIZE = 7 * 4;
+    const size_t NODE_SIZE = 6 * 4;
+    const size_t TERM_SIZE = 4 * 4;
+    const size_t POSTING_SIZE = 4 + 2 + 1;
+
+    // BM25 parameters, and how much more a word in the name is worth
+    // than the same word in the summary
+    const double BM25_K1 = 1.2;
+    const double BM25_B = 0.75;
+    const double NAME_BOOST = 2.0;
+
+    std::string lowercase(const std::string& str) {
+        std::string result = str;
+        for (auto& c : result) {
+            if (c >= 'A' && c <= 'Z') {
+                c = static_cast<char>(c - 'A' + 'a');
+            }
+        }
+
+        return result;
+    }
+}
+
+std::vector<std::string> LPM::Search::tokenize(const std::string& text) {
+    std::vector<std::string> tokens;
+    std::string token;
+
+    for (char c : text) {
+        unsigned char byte = static_cast<unsigned char>(c);
+
+        // Bytes of multibyte UTF-8 sequences are kept as part of words
+        if (std::isalnum(byte) || byte >= 0x80) {
+            token += static_cast<char>(std::tolower(byte));
+        } else if (!token.empty()) {
+            tokens.push_back(std::move(token));
+            token.clear();
+        }
+    }
+
+    if (!token.empty()) {
+        tokens.push_back(std::move(token));
+    }
+
+    return tokens;
+}
+
+void LPM::Search::Index::clear() {
+    this->file.close();
+    this->tables = Tables {};
+    this->mapped = false;
+
+    this->documents.clear();
+    this->nodes.clear();
+    this->postings.clear();
+    this->lookup.clear();
+    this->total_length = 0;
+    this->removed = 0;
+
+    // The root of the trie
+    this->nodes.push_back(Node {});
+}
+
+void LPM::Search::Index::insert(Document document) {
+    uint32_t id = static_cast<uint32_t>(this->documents.size());
+
+    struct Frequency {
+        uint16_t count = 0;
+        bool in_name = false;
+    };
+
+    std::unordered_map<std::string, Frequency> frequencies;
+    uint32_t length = 0;
+
+    for (auto& token : tokenize(document.name)) {
+        auto& frequency = frequencies[token];
+        frequency.count++;
+        frequency.in_name = true;
+        length++;
+    }
+
+    for (auto& token : tokenize(document.summary)) {
+        frequencies[token].count++;
+        length++;
+    }
+
+    for (auto& frequency : frequencies) {
+        this->postings[frequency.first].push_back(Posting {
+            id, frequency.second.count, frequency.second.in_name
+        });
+    }
+
+    document.length = length;
+    document.removed = false;
+    this->total_length += length;
+
+    this->lookup[document.repository + '\n' + document.name] = id;
+    insert_name(lowercase(document.name), id);
+    this->documents.push_back(std::move(document));
+}
+
+void LPM::Search::Index::insert_name(const std::string& name, uint32_t id) {
+    uint32_t node = 0;
+    size_t position = 0;
+
+    while (position < name.size()) {
+        // Children are kept sorted by the first character of their label
+        auto& children = this->nodes[node].children;
+        auto child_it = std::lower_bound(
+            children.begin(), children.end(), name[position],
+            [this](uint32_t child, char c) { return this->nodes[child].label[0] < c; }
+        );
+
+        if (child_it == children.end() || this->nodes[*child_it].label[0] != name[position]) {
+            uint32_t leaf = static_cast<uint32_t>(this->nodes.size());
+            children.insert(child_it, leaf);
+            this->nodes.push_back(Node { name.substr(position), {}, { id } });
+
+            return;
+        }
+
+        uint32_t child = *child_it;
+        size_t child_index = child_it - children.begin();
+        const std::string& label = this->nodes[child].label;
+
+        size_t common = 0;
+        while (
+            common < label.size() &&
+            position + common < name.size() &&
+            label[common] == name[position + common]
+        ) {
+            common++;
+        }
+
+        if (common < label.size()) {
+            // Split the edge, the shared part becomes a new inner node
+            uint32_t middle = static_cast<uint32_t>(this->nodes.size());
+            Node split { label.substr(0, common), { child }, {} };
+            this->nodes[child].label.erase(0, common);
+            this->nodes.push_back(std::move(split));
+            this->nodes[node].children[child_index] = middle;
+            child = middle;
+        }
+
+        node = child;
+        position += common;
+    }
+
+    this->nodes[node].documents.push_back(id);
+}
+
+void LPM::Search::Index::erase(uint32_t id) {
+    // Postings and trie entries are left behind and skipped at query
+    // time, until there are enough of them to compact the index
+    auto& document = this->documents[id];
+    document.removed = true;
+    this->removed++;
+    this->total_length -= document.length;
+    this->lookup.erase(document.repository + '\n' + document.name);
+}
+
+void LPM::Search::Index::compact() {
+    if (this->removed * 2 <= this->documents.size()) {
+        return;
+    }
+
+    LPM_PRINT_DEBUG("Compacting search index (" << this->removed << " removed documents)");
+    rebuild();
+}
+
+void LPM::Search::Index::rebuild() {
+    std::vector<Document> live;
+    live.reserve(this->size());
+    for (auto& document : this->documents) {
+        if (!document.removed) {
+            live.push_back(std::move(document));
+        }
+    }
+
+    clear();
+    for (auto& document : live) {
+        insert(std::move(document));
+    }
+}
+
+void LPM::Search::Index::update(const Repository& repository) {
+    thaw();
+
+    size_t added = 0, dropped = 0;
+
+    for (auto& package : repository.packages) {
+        auto found = this->lookup.find(repository.name + '\n' + package.first);
+
+        if (found != this->lookup.end()) {
+            if (this->documents[found->second].summary == package.second.summary) {
+                continue;
+            }
+
+            erase(found->second);
+        }
+
+        insert(Document { repository.name, package.first, package.second.summary, 0, false });
+        added++;
+    }
+
+    for (uint32_t id = 0; id < this->documents.size(); id++) {
+        auto& document = this->documents[id];
+
+        if (
+            !document.removed &&
+            document.repository == repository.name &&
+            !repository.packages.contains(document.name)
+        ) {
+            erase(id);
+            dropped++;
+        }
+    }
+
+    LPM_PRINT_DEBUG(
+        "Updated search index for " << repository.name << ": " <<
+        added << " added, " << dropped << " removed"
+    );
+
+    compact();
+}
+
+void LPM::Search::Index::remove(const std::string& repository_name) {
+    thaw();
+
+    for (uint32_t id = 0; id < this->documents.size(); id++) {
+        if (!this->documents[id].removed && this->documents[id].repository == repository_name) {
+            erase(id);
+        }
+    }
+
+    compact();
+}
+
+
+uint32_t LPM::Search::Index::Ids::operator[](size_t i) const {
+    return this->memory ? this->memory[i] : static_cast<uint32_t>(Utils::get_le(this->mapped + i * 4, 4));
+}
+
+LPM::Search::Index::Posting LPM::Search::Index::Postings::operator[](size_t i) const {
+    if (this->memory) {
+        return this->memory[i];
+    }
+
+    const char* entry = this->mapped + i * POSTING_SIZE;
+
+    return Posting {
+        static_cast<uint32_t>(Utils::get_le(entry, 4)),
+        static_cast<uint16_t>(Utils::get_le(entry + 4, 2)),
+        entry[6] != 0
+    };
+}
+
+// An offset and a length, pointing to a string of the mapped file
+std::string_view LPM::Search::Index::text(const char* entry) const {
+    return std::string_view(this->file.data() + Utils::get_le(entry, 4), Utils::get_le(entry + 4, 4));
+}
+
+std::string_view LPM::Search::Index::label(uint32_t node) const {
+    if (this->mapped) {
+        return text(this->tables.node_table + node * NODE_SIZE);
+    }
+
+    return this->nodes[node].label;
+}
+
+LPM::Search::Index::Ids LPM::Search::Index::children(uint32_t node) const {
+    if (this->mapped) {
+        const char* entry = this->tables.node_table + node * NODE_SIZE;
+
+        return Ids { nullptr, this->file.data() + Utils::get_le(entry + 8, 4), Utils::get_le(entry + 12, 4) };
+    }
+
+    auto& children = this->nodes[node].children;
+
+    return Ids { children.data(), nullptr, children.size() };
+}
+
+LPM::Search::Index::Ids LPM::Search::Index::node_documents(uint32_t node) const {
+    if (this->mapped) {
+        const char* entry = this->tables.node_table + node * NODE_SIZE;
+
+        return Ids { nullptr, this->file.data() + Utils::get_le(entry + 16, 4), Utils::get_le(entry + 20, 4) };
+    }
+
+    auto& documents = this->nodes[node].documents;
+
+    return Ids { documents.data(), nullptr, documents.size() };
+}
+
+LPM::Search::Index::Postings LPM::Search::Index::find(const std::string& token) const {
+    if (!this->mapped) {
+        auto found = this->postings.find(token);
+        if (found == this->postings.end()) {
+            return Postings { nullptr, nullptr, 0 };
+        }
+
+        return Postings { found->second.data(), nullptr, found->second.size() };
+    }
+
+    // Terms are sorted, see save()
+    size_t low = 0, high = this->tables.terms;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if (text(this->tables.term_table + middle * TERM_SIZE) < token) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    const char* entry = this->tables.term_table + low * TERM_SIZE;
+    if (low == this->tables.terms || text(entry) != token) {
+        return Postings { nullptr, nullptr, 0 };
+    }
+
+    return Postings { nullptr, this->file.data() + Utils::get_le(entry + 8, 4), Utils::get_le(entry + 12, 4) };
+}
+
+bool LPM::Search::Index::is_removed(uint32_t id) const {
+    // A saved index holds no removed documents
+    return !this->mapped && this->documents[id].removed;
+}
+
+uint32_t LPM::Search::Index::length(uint32_t id) const {
+    if (this->mapped) {
+        return static_cast<uint32_t>(Utils::get_le(this->tables.document_table + id * DOCUMENT_SIZE + 24, 4));
+    }
+
+    return this->documents[id].length;
+}
+
+void LPM::Search::Index::thaw() {
+    if (!this->mapped) {
+        return;
+    }
+
+    std::vector<Document> documents;
+    documents.reserve(this->tables.documents);
+
+    for (uint32_t id = 0; id < this->tables.documents; id++) {
+        const char* entry = this->tables.document_table + id * DOCUMENT_SIZE;
+
+        documents.push_back(Document {
+            std::string(text(entry)),
+            std::string(text(entry + 8)),
+            std::string(text(entry + 16)),
+            length(id),
+            false
+        });
+    }
+
+    std::vector<Node> nodes(this->tables.nodes);
+
+    for (uint32_t node = 0; node < this->tables.nodes; node++) {
+        nodes[node].label = label(node);
+
+        Ids ids = children(node);
+        for (size_t i = 0; i < ids.size(); i++) {
+            nodes[node].children.push_back(ids[i]);
+        }
+
+        ids = node_documents(node);
+        for (size_t i = 0; i < ids.size(); i++) {
+            nodes[node].documents.push_back(ids[i]);
+        }
+    }
+
+    std::unordered_map<std::string, std::vector<Posting>> postings;
+    postings.reserve(this->tables.terms);
+
+    for (uint32_t term = 0; term < this->tables.terms; term++) {
+        const char* entry = this->tables.term_table + term * TERM_SIZE;
+        Postings list { nullptr, this->file.data() + Utils::get_le(entry + 8, 4), Utils::get_le(entry + 12, 4) };
+
+        auto& copy = postings[std::string(text(entry))];
+        copy.reserve(list.size());
+
+        for (size_t i = 0; i < list.size(); i++) {
+            // Unlike the tables, postings weren't checked by load()
+            if (list[i].document < documents.size()) {
+                copy.push_back(list[i]);
+            }
+        }
+    }
+
+    this->file.close();
+    this->tables = Tables {};
+    this->mapped = false;
+
+    this->documents = std::move(documents);
+    this->nodes = std::move(nodes);
+    this->postings = std::move(postings);
+
+    for (uint32_t id = 0; id < this->documents.size(); id++) {
+        this->lookup[this->documents[id].repository + '\n' + this->documents[id].name] = id;
+    }
+}
+
+LPM::Search::Result LPM::Search::Index::result(uint32_t id, double score) const {
+    if (this->mapped) {
+        const char* entry = this->tables.document_table + id * DOCUMENT_SIZE;
+
+        return Result {
+            std::string(text(entry)),
+            std::string(text(entry + 8)),
+            std::string(text(entry + 16)),
+            score
+        };
+    }
+
+    auto& document = this->documents[id];
+
+    return Result { document.repository, document.name, document.summary, score };
+}
+
+void LPM::Search::Index::collect(
+    uint32_t node,
+    size_t limit,
+    std::vector<Result>& results
+) const {
+    Ids documents = node_documents(node);
+    for (size_t i = 0; i < documents.size(); i++) {
+        if (results.size() >= limit) {
+            return;
+        }
+
+        if (!is_removed(documents[i])) {
+            results.push_back(result(documents[i], 0));
+        }
+    }
+
+    Ids nodes = children(node);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (results.size() >= limit) {
+            return;
+        }
+
+        collect(nodes[i], limit, results);
+    }
+}
+
+std::vector<LPM::Search::Result> LPM::Search::Index::prefix(
+    const std::string& prefix,
+    size_t limit
+) const {
+    std::vector<Result> results;
+    std::string key = lowercase(prefix);
+
+    uint32_t node = 0;
+    size_t position = 0;
+
+    while (position < key.size()) {
+        uint32_t next = 0;
+
+        Ids nodes = children(node);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (label(nodes[i])[0] == key[position]) {
+                next = nodes[i];
+                break;
+            }
+        }
+
+        if (next == 0) {
+            return results;
+        }
+
+        std::string_view next_label = label(next);
+        size_t remaining = key.size() - position;
+        size_t compared = std::min(remaining, next_label.size());
+
+        if (next_label.compare(0, compared, key, position, compared) != 0) {
+            return results;
+        }
+
+        node = next;
+        position += compared;
+    }
+
+    collect(node, limit, results);
+
+    return results;
+}
+
+std::vector<LPM::Search::Result> LPM::Search::Index::query(
+    const std::string& text,
+    size_t limit
+) const {
+    std::vector<Result> results;
+
+    size_t count = this->size();
+    if (count == 0) {
+        return results;
+    }
+
+    double average_length = std::max(1.0, static_cast<double>(this->total_length) / count);
+
+    std::vector<std::string> tokens = tokenize(text);
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    std::unordered_map<uint32_t, double> scores;
+
+    for (auto& token : tokens) {
+        Postings found = find(token);
+        if (found.size() == 0) {
+            continue;
+        }
+
+        double frequency = static_cast<double>(found.size());
+        double idf = std::log(1.0 + (count - frequency + 0.5) / (frequency + 0.5));
+
+        for (size_t i = 0; i < found.size(); i++) {
+            Posting posting = found[i];
+
+            // Document ids of mapped postings are only checked here
+            if (posting.document >= count + this->removed || is_removed(posting.document)) {
+                continue;
+            }
+
+            double tf = posting.frequency;
+            double score = idf * tf * (BM25_K1 + 1) / (
+                tf + BM25_K1 * (1 - BM25_B + BM25_B * length(posting.document) / average_length)
+            );
+
+            scores[posting.document] += posting.in_name ? score * NAME_BOOST : score;
+        }
+    }
+
+    std::vector<std::pair<uint32_t, double>> ranked(scores.begin(), scores.end());
+
+    size_t top = std::min(limit, ranked.size());
+
+    std::partial_sort(
+        ranked.begin(), ranked.begin() + top, ranked.end(),
+        [](const auto& a, const auto& b) {
+            if (a.second != b.second) {
+                return a.second > b.second;
+            }
+
+            // Ties go to the package that was indexed first
+            return a.first < b.first;
+        }
+    );
+
+    results.reserve(top);
+    for (size_t i = 0; i < top; i++) {
+        results.push_back(result(ranked[i].first, ranked[i].second));
+    }
+
+    return results;
+}
+
+void LPM::Search::Index::load() {
+    clear();
+
+    // A missing index is rebuilt as repositories get refreshed
+    if (!std::filesystem::exists(this->path)) {
+        return;
+    }
+
+    std::string error;
+    if (!this->file.open(this->path, error)) {
+        throw std::runtime_error("Failed to open search index: " + error);
+    }
+
+    const char* data = this->file.data();
+    size_t size = this->file.size();
+
+    if (
+        size < sizeof(SEARCH_MAGIC) ||
+        std::memcmp(data, SEARCH_MAGIC, sizeof(SEARCH_MAGIC) - 1) != 0
+    ) {
+        clear();
+        throw std::runtime_error("Not a search index: " + this->path);
+    }
+
+    // So is one of another version, the next save replaces it
+    if (data[sizeof(SEARCH_MAGIC) - 1] != SEARCH_MAGIC[sizeof(SEARCH_MAGIC) - 1]) {
+        LPM_PRINT_DEBUG("Ignoring search index of another version: " << this->path);
+        clear();
+
+        return;
+    }
+
+    Tables tables;
+    uint64_t total_length = 0;
+
+    if (size >= HEADER_SIZE) {
+        const char* header = data + sizeof(SEARCH_MAGIC);
+        tables.documents = static_cast<uint32_t>(Utils::get_le(header, 4));
+        tables.nodes = static_cast<uint32_t>(Utils::get_le(header + 4, 4));
+        tables.terms = static_cast<uint32_t>(Utils::get_le(header + 8, 4));
+        total_length = Utils::get_le(header + 12, 8);
+    }
+
+    uint64_t tables_size =
+        uint64_t(tables.documents) * DOCUMENT_SIZE +
+        uint64_t(tables.nodes) * NODE_SIZE +
+        uint64_t(tables.terms) * TERM_SIZE;
+
+    if (size < HEADER_SIZE || tables.nodes == 0 || tables_size > size - HEADER_SIZE) {
+        clear();
+        throw std::runtime_error("Corrupted search index: " + this->path);
+    }
+
+    tables.document_table = data + HEADER_SIZE;
+    tables.node_table = tables.document_table + tables.documents * DOCUMENT_SIZE;
+    tables.term_table = tables.node_table + tables.nodes * NODE_SIZE;
+
+    // Whether the offset and count at entry fit in the file. Every table
+    // entry is checked once here, so lookups can trust them.
+    auto fits = [&](const char* entry, uint64_t item_size) {
+        uint64_t offset = Utils::get_le(entry, 4), count = Utils::get_le(entry + 4, 4);
+
+        return offset <= size && count * item_size <= size - offset;
+    };
+
+    bool valid = true;
+
+    for (uint32_t id = 0; valid && id < tables.documents; id++) {
+        const char* entry = tables.document_table + id * DOCUMENT_SIZE;
+        valid = fits(entry, 1) && fits(entry + 8, 1) && fits(entry + 16, 1);
+    }
+
+    // Children come after their parent, so the trie has no cycles
+    for (uint32_t node = 0; valid && node < tables.nodes; node++) {
+        const char* entry = tables.node_table + node * NODE_SIZE;
+        valid =
+            fits(entry, 1) && (node == 0 || Utils::get_le(entry + 4, 4) > 0) &&
+            fits(entry + 8, 4) && fits(entry + 16, 4);
+
+        const char* ids = data + Utils::get_le(entry + 8, 4);
+        for (uint64_t i = 0, count = Utils::get_le(entry + 12, 4); valid && i < count; i++) {
+            uint64_t child = Utils::get_le(ids + i * 4, 4);
+            valid = child > node && child < tables.nodes;
+        }
+
+        ids = data + Utils::get_le(entry + 16, 4);
+        for (uint64_t i = 0, count = Utils::get_le(entry + 20, 4); valid && i < count; i++) {
+            valid = Utils::get_le(ids + i * 4, 4) < tables.documents;
+        }
+    }
+
+    for (uint32_t term = 0; valid && term < tables.terms; term++) {
+        const char* entry = tables.term_table + term * TERM_SIZE;
+        valid = fits(entry, 1) && fits(entry + 8, POSTING_SIZE);
+    }
+
+    if (!valid) {
+        clear();
+        throw std::runtime_error("Corrupted search index: " + this->path);
+    }
+
+    this->tables = tables;
+    this->total_length = total_length;
+    this->mapped = true;
+
+    LPM_PRINT_DEBUG(
+        "Mapped search index " << this->path << ": " << tables.documents << " documents, " <<
+        tables.nodes << " nodes, " << tables.terms << " terms"
+    );
+}
+
+// Layout, all integers little-endian:
+//
+//   magic, document count (4), node count (4), term count (4),
+//   total length (8)
+//   documents  repository, name, summary, length (4)
+//   nodes      label, children, documents
+//   terms      term, postings
+//   strings, ids (4 each) and postings (document (4), frequency (2),
+//   in name (1)) the entries point to
+//
+// where a string is an offset and a length, and a list an offset and a
+// count (4 bytes each). Nodes are in depth-first order and terms sorted.
+void LPM::Search::Index::save() {
+    // Nothing changed since it was loaded
+    if (this->mapped) {
+        return;
+    }
+
+    // Renumbers the documents without the removed ones
+    if (this->removed > 0) {
+        rebuild();
+    }
+
+    std::vector<uint32_t> order, renumbered(this->nodes.size());
+    order.reserve(this->nodes.size());
+
+    std::vector<uint32_t> stack { 0 };
+    while (!stack.empty()) {
+        uint32_t node = stack.back();
+        stack.pop_back();
+
+        renumbered[node] = static_cast<uint32_t>(order.size());
+        order.push_back(node);
+
+        auto& children = this->nodes[node].children;
+        stack.insert(stack.end(), children.rbegin(), children.rend());
+    }
+
+    std::vector<const std::pair<const std::string, std::vector<Posting>>*> terms;
+    terms.reserve(this->postings.size());
+    for (auto& term : this->postings) {
+        terms.push_back(&term);
+    }
+
+    std::sort(terms.begin(), terms.end(), [](auto a, auto b) { return a->first < b->first; });
+
+    uint64_t pool_start =
+        HEADER_SIZE + this->documents.size() * DOCUMENT_SIZE +
+        order.size() * NODE_SIZE + terms.size() * TERM_SIZE;
+
+    std::string data(SEARCH_MAGIC, sizeof(SEARCH_MAGIC)), pool;
+    data.reserve(pool_start);
+
+    Utils::put_le(data, this->documents.size(), 4);
+    Utils::put_le(data, order.size(), 4);
+    Utils::put_le(data, terms.size(), 4);
+    Utils::put_le(data, this->total_length, 8);
+
+    auto put_text = [&](std::string_view value) {
+        Utils::put_le(data, pool_start + pool.size(), 4);
+        Utils::put_le(data, value.size(), 4);
+        pool += value;
+    };
+
+    auto put_ids = [&](const std::vector<uint32_t>& ids, const std::vector<uint32_t>* renumber) {
+        Utils::put_le(data, pool_start + pool.size(), 4);
+        Utils::put_le(data, ids.size(), 4);
+
+        for (auto id : ids) {
+            Utils::put_le(pool, renumber ? (*renumber)[id] : id, 4);
+        }
+    };
+
+    for (auto& document : this->documents) {
+        put_text(document.repository);
+        put_text(document.name);
+        put_text(document.summary);
+        Utils::put_le(data, document.length, 4);
+    }
+
+    for (auto node : order) {
+        put_text(this->nodes[node].label);
+        put_ids(this->nodes[node].children, &renumbered);
+        put_ids(this->nodes[node].documents, nullptr);
+    }
+
+    for (auto term : terms) {
+        put_text(term->first);
+        Utils::put_le(data, pool_start + pool.size(), 4);
+        Utils::put_le(data, term->second.size(), 4);
+
+        for (auto& posting : term->second) {
+            Utils::put_le(pool, posting.document, 4);
+            Utils::put_le(pool, posting.frequency, 2);
+            pool.push_back(posting.in_name ? 1 : 0);
+        }
+    }
+
+    if (pool_start + pool.size() > UINT32_MAX) {
+        throw std::runtime_error("Search index too large for its 32-bit offsets: " + this->path);
+    }
+
+    data += pool;
+
+    // Replaced atomically, readers keep their mapping
+    if (!Utils::replace_file(this->path, data)) {
+        throw std::runtime_error("Failed to write to file: " + this->path);
+    }
+}
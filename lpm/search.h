@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include "manifests.h"
+#include "utils.h"
+
+using namespace LPM::Manifests;
+
+namespace LPM::Search {
+    struct Result {
+        std::string repository, name, summary;
+        double score;
+    };
+
+    // A search index over the packages of every repository, meant to live
+    // next to repositories_cache. Package names go into a compressed trie
+    // for prefix lookups, and names and summaries into an inverted index
+    // ranked with BM25.
+    //
+    // The file holds the documents, the trie and the postings as flat
+    // little-endian tables. load() maps it and answers queries straight
+    // from the mapping, the first update copies it into memory.
+    class Index {
+    public:
+        Index(const std::string& path) {
+            this->path = path;
+            this->load();
+        }
+
+        std::string path;
+
+        // Bring the packages of a refreshed repository up to date, only
+        // touching the ones that were added, removed or changed
+        void update(const Repository& repository);
+        void remove(const std::string& repository_name);
+
+        // Packages whose name starts with prefix, in name order
+        std::vector<Result> prefix(const std::string& prefix, size_t limit = 20) const;
+
+        // Packages matching any word of text, best match first
+        std::vector<Result> query(const std::string& text, size_t limit = 20) const;
+
+        size_t size() const { return (mapped ? tables.documents : documents.size()) - removed; }
+
+        void load();
+        void save();
+    private:
+        struct Document {
+            std::string repository, name, summary;
+            uint32_t length;
+            bool removed;
+        };
+
+        struct Node {
+            std::string label;
+            std::vector<uint32_t> children;
+            std::vector<uint32_t> documents;
+        };
+
+        struct Posting {
+            uint32_t document;
+            uint16_t frequency;
+            bool in_name;
+        };
+
+        // Ids of a node's children or documents, in memory or mapped
+        struct Ids {
+            const uint32_t* memory;
+            const char* mapped;
+            size_t count;
+
+            size_t size() const { return count; }
+            uint32_t operator[](size_t i) const;
+        };
+
+        struct Postings {
+            const Posting* memory;
+            const char* mapped;
+            size_t count;
+
+            size_t size() const { return count; }
+            Posting operator[](size_t i) const;
+        };
+
+        // Table entries of the mapped file, see save() for the layout
+        struct Tables {
+            uint32_t documents = 0, nodes = 0, terms = 0;
+            const char *document_table = nullptr, *node_table = nullptr, *term_table = nullptr;
+        };
+
+        std::vector<Document> documents;
+        std::vector<Node> nodes;
+        std::unordered_map<std::string, std::vector<Posting>> postings;
+        std::unordered_map<std::string, uint32_t> lookup;
+        uint64_t total_length = 0;
+        size_t removed = 0;
+
+        Utils::MappedFile file;
+        Tables tables;
+        bool mapped = false;
+
+        void clear();
+        void thaw();
+        void insert(Document document);
+        void erase(uint32_t id);
+        void compact();
+        void rebuild();
+
+        std::string_view text(const char* entry) const;
+        std::string_view label(uint32_t node) const;
+        Ids children(uint32_t node) const;
+        Ids node_documents(uint32_t node) const;
+        Postings find(const std::string& token) const;
+        bool is_removed(uint32_t id) const;
+        uint32_t length(uint32_t id) const;
+
+        void insert_name(const std::string& name, uint32_t id);
+        void collect(uint32_t node, size_t limit, std::vector<Result>& results) const;
+        Result result(uint32_t id, double score) const;
+    };
+
+    // Lowercase alphanumeric words of text
+    std::vector<std::string> tokenize(const std::string& text);
+}
@@ -0,0 +1,300 @@
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include "sparse.h"
+#include "macros.h"
+#include "requests.h"
+#include "utils.h"
+#include "toml11/toml.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+    // Names become paths in the cache and in generated repositories:
+    // letters, digits, '_' and '-', with dots only between them
+    bool valid_name(const std::string& name) {
+        if (name.empty() || name.front() == '.' || name.back() == '.') {
+            return false;
+        }
+
+        for (size_t i = 0; i < name.size(); i++) {
+            char c = name[i];
+            bool allowed =
+                (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '_' || c == '-' ||
+                (c == '.' && name[i - 1] != '.');
+
+            if (!allowed) {
+                return false;
+            }
+        }
+
+        // No shard component can be "." or ".." then, check anyway since
+        // shard() is what ends up in the path
+        std::string shard = LPM::Sparse::shard(name);
+        for (auto& component : LPM::Utils::split(shard, '/')) {
+            if (component == "." || component == "..") {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::string package_file(const std::string& name) {
+        return LPM::Sparse::shard(name) + name + ".toml";
+    }
+
+    LPM::Manifests::Repository::Package parse_package(
+        const std::string& name,
+        const toml::value& data
+    ) {
+        std::map<std::string, std::string> versions;
+        if (data.contains("versions")) {
+            versions = toml::find<
+                std::map<std::string, std::string>
+            >(data, "versions");
+        }
+
+        return LPM::Manifests::Repository::Package {
+            name,
+            toml::find_or(data, "summary", ""),
+            toml::find_or(data, "package_type", ""),
+            std::move(versions)
+        };
+    }
+}
+
+LPM::Sparse::Index::Index(const std::string& url, const std::string& cache_path) {
+    this->url = url;
+    this->cache_path = cache_path;
+
+    while (!this->url.empty() && this->url.back() == '/') {
+        this->url.pop_back();
+    }
+
+    // One handle for every package, so the connection is kept alive
+    this->curl_handle = Requests::handle();
+    if (!this->curl_handle) {
+        throw std::runtime_error("Failed to initialize curl");
+    }
+}
+
+LPM::Sparse::Index::~Index() {
+    curl_easy_cleanup(this->curl_handle);
+}
+
+std::string LPM::Sparse::shard(const std::string& name) {
+    switch (name.size()) {
+        case 1:
+            return "1/";
+        case 2:
+            return "2/";
+        case 3:
+            return "3/" + name.substr(0, 1) + "/";
+        default:
+            return name.substr(0, 2) + "/" + name.substr(2, 2) + "/";
+    }
+}
+
+const LPM::Manifests::Repository::Package* LPM::Sparse::Index::get(
+    const std::string& name,
+    std::string& error
+) {
+    auto found = this->packages.find(name);
+    if (found != this->packages.end()) {
+        return &found->second;
+    }
+
+    if (!valid_name(name)) {
+        error = "Invalid package name '" + name + "'";
+
+        return nullptr;
+    }
+
+    std::string relative_path = package_file(name);
+    std::string cached_path = (fs::path(this->cache_path) / relative_path).string();
+    std::string validators_path = cached_path + ".validators";
+    bool cached = fs::exists(cached_path);
+
+    if (!this->offline) {
+        // Ask the server to skip the body if our copy is still current
+        std::map<std::string, std::string> headers;
+        std::map<std::string, std::string> validators;
+
+        if (cached && fs::exists(validators_path)) {
+            try {
+                validators = toml::find<
+                    std::map<std::string, std::string>
+                >(toml::parse(validators_path), "validators");
+            } catch (const std::exception& e) {
+                LPM_PRINT_DEBUG("Ignoring unreadable validators " << validators_path << ": " << e.what());
+            }
+
+            if (validators.contains("etag")) {
+                headers["If-None-Match"] = validators["etag"];
+            }
+
+            if (validators.contains("last-modified")) {
+                headers["If-Modified-Since"] = validators["last-modified"];
+            }
+        }
+
+        std::string package_url = this->url + "/" + relative_path;
+        Requests::Response response = Requests::get(package_url, this->curl_handle, headers);
+
+        if (response.status_code == 200) {
+            // Parsed before it is saved, so a broken response never
+            // replaces a good copy
+            std::optional<Manifests::Repository::Package> package;
+            try {
+                std::istringstream body(response.body);
+                package.emplace(parse_package(name, toml::parse(body, package_url)));
+            } catch (const std::exception& e) {
+                if (!cached) {
+                    error = "Invalid package metadata from url '" + package_url + "': " + e.what();
+
+                    return nullptr;
+                }
+
+                LPM_PRINT_DEBUG("Using cached metadata for " << name << ", invalid response: " << e.what());
+            }
+
+            if (package) {
+                if (!Utils::replace_file(cached_path, response.body)) {
+                    error = "Failed to save package metadata to " + cached_path;
+
+                    return nullptr;
+                }
+
+                toml::value data;
+                data["validators"] = toml::value{};
+                for (auto& header : { "etag", "last-modified" }) {
+                    if (response.headers.contains(header)) {
+                        data["validators"][header] = response.headers[header];
+                    }
+                }
+
+                std::stringstream stream;
+                stream << data;
+                Utils::replace_file(validators_path, stream.str());
+
+                LPM_PRINT_DEBUG("Fetched package metadata " << package_url);
+
+                return &this->packages.emplace(name, std::move(*package)).first->second;
+            }
+        } else if (response.status_code == 304) {
+            LPM_PRINT_DEBUG("Package metadata for " << name << " is up to date");
+        } else if (response.status_code == 404 || response.status_code == 410) {
+            error = "Package '" + name + "' was not found in " + this->url;
+
+            return nullptr;
+        } else if (!cached) {
+            error =
+                "Failed to fetch package metadata from url '" + package_url + "': " +
+                std::to_string(response.status_code);
+
+            return nullptr;
+        } else {
+            // Any other failure falls back to what we already have
+            LPM_PRINT_DEBUG(
+                "Using cached metadata for " << name << " (status " <<
+                response.status_code << ")"
+            );
+        }
+    }
+
+    if (!cached) {
+        error = "Package '" + name + "' is not in the cache of " + this->url;
+
+        return nullptr;
+    }
+
+    try {
+        auto inserted = this->packages.emplace(name, parse_package(name, toml::parse(cached_path)));
+
+        return &inserted.first->second;
+    } catch (const std::exception& e) {
+        error = "Failed to read package metadata " + cached_path + ": " + e.what();
+
+        return nullptr;
+    }
+}
+
+bool LPM::Sparse::Index::resolve(
+    const std::map<std::string, std::string>& dependencies,
+    std::string& error
+) {
+    for (auto& dependency : dependencies) {
+        const Manifests::Repository::Package* package = get(dependency.first, error);
+        if (!package) {
+            return false;
+        }
+
+        if (!package->versions.contains(dependency.second)) {
+            error = "Package '" + dependency.first + "' has no version '" + dependency.second + "'";
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool LPM::Sparse::generate(
+    const Manifests::Repository& repository,
+    const std::string& output_path,
+    std::string& error
+) {
+    toml::value config;
+    config["repository"] = toml::value {
+        {"name", repository.name},
+        {"summary", repository.summary}
+    };
+
+    std::stringstream config_stream;
+    config_stream << config;
+
+    std::string config_path = (fs::path(output_path) / "config.toml").string();
+    if (!Utils::write_file(config_path, config_stream.str())) {
+        error = "Failed to write " + config_path;
+
+        return false;
+    }
+
+    for (auto& package : repository.packages) {
+        if (!valid_name(package.first)) {
+            error = "Invalid package name '" + package.first + "'";
+
+            return false;
+        }
+
+        toml::value data {
+            {"summary", package.second.summary},
+            {"package_type", package.second.package_type}
+        };
+
+        data["versions"] = toml::value{};
+        for (auto& version : package.second.versions) {
+            data["versions"][version.first] = version.second;
+        }
+
+        std::stringstream stream;
+        stream << data;
+
+        std::string path = (fs::path(output_path) / package_file(package.first)).string();
+        if (!Utils::write_file(path, stream.str())) {
+            error = "Failed to write " + path;
+
+            return false;
+        }
+    }
+
+    LPM_PRINT_DEBUG(
+        "Generated sparse repository " << repository.name << " with " <<
+        repository.packages.size() << " packages at " << output_path
+    );
+
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <curl/curl.h>
+#include <map>
+#include <string>
+#include "manifests.h"
+
+namespace LPM::Sparse {
+    // A sparse repository serves one small TOML file per package instead
+    // of a single file listing every package:
+    //
+    //   <url>/config.toml          name and summary of the repository
+    //   <url>/<shard>/<name>.toml  summary, package_type and versions
+    //
+    // where the shard depends on the package name (see shard()), so no
+    // directory grows too large. Package files are fetched on demand and
+    // cached individually, and revalidated with ETag/Last-Modified.
+    class Index {
+    public:
+        Index(const std::string& url, const std::string& cache_path);
+        ~Index();
+
+        Index(const Index&) = delete;
+        Index& operator=(const Index&) = delete;
+
+        std::string url, cache_path;
+
+        // Packages fetched (or read from the cache) so far
+        std::map<std::string, Manifests::Repository::Package> packages;
+
+        // Skip revalidation and only use what is cached
+        bool offline = false;
+
+        // Returns nullptr and sets error if the package can't be found
+        const Manifests::Repository::Package* get(const std::string& name, std::string& error);
+
+        // Fetch the metadata of every dependency, and nothing else
+        bool resolve(
+            const std::map<std::string, std::string>& dependencies,
+            std::string& error
+        );
+    private:
+        CURL* curl_handle;
+    };
+
+    // Relative directory of a package: 1/, 2/, 3/<a>/ or <ab>/<cd>/
+    std::string shard(const std::string& name);
+
+    // Write the sparse layout of a repository under output_path,
+    // ready to be served by any static HTTP server
+    bool generate(
+        const Manifests::Repository& repository,
+        const std::string& output_path,
+        std::string& error
+    );
+}
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include "stats.h"
+#include "macros.h"
+
+namespace {
+    std::mutex latencies_mutex;
+    std::vector<double> latencies;
+
+    std::mutex windows_mutex;
+    std::deque<LPM::Stats::WindowChange> windows;
+}
+
+LPM::Stats::Counters& LPM::Stats::counters() {
+    static Counters instance;
+
+    return instance;
+}
+
+void LPM::Stats::record_install(const std::string& package_name, double seconds) {
+    {
+        std::lock_guard<std::mutex> lock(latencies_mutex);
+        latencies.push_back(seconds);
+    }
+
+    LPM_PRINT_DEBUG("Installed " << package_name << " in " << seconds << "s");
+}
+
+std::vector<double> LPM::Stats::install_latencies() {
+    std::lock_guard<std::mutex> lock(latencies_mutex);
+
+    return latencies;
+}
+
+void LPM::Stats::record_window(
+    const std::string& host,
+    double window,
+    const std::string& reason
+) {
+    {
+        std::lock_guard<std::mutex> lock(windows_mutex);
+        windows.push_back(WindowChange { host, window, reason });
+
+        if (windows.size() > LPM_STATS_MAX_WINDOW_CHANGES) {
+            windows.pop_front();
+        }
+    }
+
+    LPM_PRINT_DEBUG("Download window for " << host << " is " << window << " (" << reason << ")");
+}
+
+std::vector<LPM::Stats::WindowChange> LPM::Stats::window_changes() {
+    std::lock_guard<std::mutex> lock(windows_mutex);
+
+    return std::vector<WindowChange>(windows.begin(), windows.end());
+}
+
+double LPM::Stats::quantile(std::vector<double> values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+
+    // Nearest rank
+    size_t rank = static_cast<size_t>(std::ceil(q * values.size()));
+    size_t index = std::min(values.size() - 1, rank > 0 ? rank - 1 : 0);
+
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+
+    return values[index];
+}
+
+void LPM::Stats::reset() {
+    Counters& current = counters();
+
+    for (auto* counter : {
+        &current.requests, &current.failed_requests, &current.bytes_downloaded,
+        &current.files_written, &current.bytes_written, &current.directories_created,
+        &current.zero_copy_bytes, &current.installs, &current.failed_installs,
+        &current.cache_hits,
+        &current.fetch_window, &current.fetch_increases, &current.fetch_decreases,
+        &current.fetch_holds, &current.fetch_retries
+    }) {
+        counter->store(0);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(windows_mutex);
+        windows.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(latencies_mutex);
+    latencies.clear();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace LPM::Stats {
+    // Process-wide counters, updated by the library as it works, so tools
+    // and benchmarks can see what an operation actually cost
+    struct Counters {
+        std::atomic<std::uint64_t>
+            requests { 0 }, failed_requests { 0 }, bytes_downloaded { 0 },
+            files_written { 0 }, bytes_written { 0 }, directories_created { 0 },
+            zero_copy_bytes { 0 },
+            installs { 0 }, failed_installs { 0 }, cache_hits { 0 },
+            fetch_window { 0 }, fetch_increases { 0 }, fetch_decreases { 0 },
+            fetch_holds { 0 }, fetch_retries { 0 };
+    };
+
+    // A change of a host's download window, and what caused it
+    // (success, latency, throughput or congestion)
+    struct WindowChange {
+        std::string host;
+        double window;
+        std::string reason;
+    };
+
+    Counters& counters();
+
+    // Wall time of one successful install, in seconds
+    void record_install(const std::string& package_name, double seconds);
+
+    // Every recorded install latency since the last reset(), in seconds
+    std::vector<double> install_latencies();
+
+    // Only the last LPM_STATS_MAX_WINDOW_CHANGES changes are kept
+    void record_window(const std::string& host, double window, const std::string& reason);
+    std::vector<WindowChange> window_changes();
+
+    // The q-th quantile (0 to 1) of values, 0 if there are none
+    double quantile(std::vector<double> values, double q);
+
+    void reset();
+}
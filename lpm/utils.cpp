@@ -1,13 +1,31 @@
+#include <algorithm>
 #include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
 #include <zip.h>
 #include "utils.h"
 #include "macros.h"
+#include "stats.h"
+#include "io.h"
+#include "scope_destructor.h"
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/wait.h>
+#endif
 
 void LPM::Utils::format(
     std::string& format_str,
-    std::map<std::string, std::string> args
+    const std::map<std::string, std::string>& args
 ) {
     // Replace ${key} with the value of the environment variable named key
+    std::string key;
     size_t start_pos = format_str.find("${");
     while (start_pos != std::string::npos) {
         size_t end_pos = format_str.find("}", start_pos);
@@ -15,20 +33,25 @@ void LPM::Utils::format(
             break;
         }
 
-        std::string key = format_str.substr(
+        // Reused across placeholders, short keys never leave the
+        // small string buffer
+        key.assign(
+            format_str,
             start_pos + 2,
             end_pos - start_pos - 2
         );
 
-        std::string value = args[key];
+        auto found = args.find(key);
 
-        if (value == "") {
+        if (found == args.end() || found->second.empty()) {
             throw std::runtime_error(
                 "Failed to format string: " + format_str +
                 " because key \"" + key + "\" is empty"
             );
         }
 
+        const std::string& value = found->second;
+
         format_str.replace(
             start_pos,
             end_pos - start_pos + 1,
@@ -39,51 +62,129 @@ void LPM::Utils::format(
     }
 }
 
+bool LPM::Utils::create_parent_directories(const std::string& path) {
+    size_t separator = path.find_last_of('/');
+    if (separator == std::string::npos || separator == 0) {
+        return true;
+    }
+
+    // The common case is a parent that already exists, which costs a
+    // single stat. Missing ones are created from the top down.
+    std::string parent = path.substr(0, separator);
+    std::error_code error;
+
+    if (fs::is_directory(parent, error)) {
+        return true;
+    }
+
+    if (!create_parent_directories(parent)) {
+        return false;
+    }
+
+    LPM_PRINT_DEBUG("Creating directory " << parent);
+    if (!fs::create_directory(parent, error) && !fs::is_directory(parent, error)) {
+        LPM_PRINT_DEBUG("Failed to create directory " << parent);
+        return false;
+    }
+
+    Stats::counters().directories_created++;
+
+    return true;
+}
+
 bool LPM::Utils::write_file(
     const std::string& path,
     const std::string& content
 ) {
     LPM_PRINT_DEBUG("Writing file " << path);
-    // Split path into segments
-    std::vector<std::string> segments = split(path, '/');
 
-    // Print segments
-    for (const auto& segment : segments) {
-        LPM_PRINT_DEBUG("Segment: " << segment);
+    IO::Backend& io = IO::local();
+    std::string error;
+
+    if (!io.write(path, content.data(), content.size(), error) || !io.flush(error)) {
+        io.discard();
+        LPM_PRINT_ERROR(error);
+
+        return false;
     }
-    // Check if all segments except the last one exist
-    for (size_t i =  0; i < segments.size() - 1; i++) {
-        std::string segment = segments[i];
-        if (segment == "") {
-            continue;
-        }
 
-        std::string curr_path = join(segments, '/', 0, i);
-        LPM_PRINT_DEBUG("Checking if directory " << curr_path << " exists");
-        if (!fs::exists(curr_path)) {
-            LPM_PRINT_DEBUG("Creating directory " << curr_path);
-            if (!fs::create_directory(curr_path)) {
-                LPM_PRINT_DEBUG("Failed to create directory " << curr_path);
-                return false;
-            }
-        }
+    LPM_PRINT_DEBUG("Wrote file " << path);
+
+    return true;
+}
+
+std::string LPM::Utils::temporary_path(const std::string& path) {
+    std::random_device random;
+
+    return path + "." + to_hex((static_cast<uint64_t>(random()) << 32) | random()) + ".tmp";
+}
+
+bool LPM::Utils::replace_file(
+    const std::string& path,
+    const std::string& content
+) {
+    std::string temporary = temporary_path(path);
+    if (!write_file(temporary, content)) {
+        return false;
     }
 
-    std::ofstream file(path);
-    if (!file.is_open()) {
+    std::error_code error;
+    fs::rename(temporary, path, error);
+    if (error) {
+        LPM_PRINT_ERROR("Failed to move " << temporary << " to " << path << ": " << error.message());
+        fs::remove(temporary, error);
+
         return false;
     }
 
-    try {
-        file << content;
-    } catch (...) {
-        LPM_PRINT_ERROR("Failed to write file " << path);
+    return true;
+}
+
+bool LPM::Utils::read_entry(
+    zip* zip_file,
+    zip_uint64_t index,
+    std::string& content,
+    std::string& error
+) {
+    struct zip_stat sb;
+    zip_stat_init(&sb);
+
+    if (zip_stat_index(zip_file, index, 0, &sb) != 0) {
+        error = "Unable to retrieve file information from zip. (Index: " + std::to_string(index) + ")";
+
         return false;
     }
 
-    file.close();
+    // Open the file via index
+    struct zip_file* current_file = zip_fopen_index(zip_file, index, 0);
+    if (!current_file) {
+        error = "Failed to open zip file entry";
 
-    LPM_PRINT_DEBUG("Wrote file " << path);
+        return false;
+    }
+
+    content.clear();
+    if (sb.valid & ZIP_STAT_SIZE) {
+        content.reserve(sb.size);
+    }
+
+    // Read straight into the content, in LPM_ZIP_BUFFER_SIZE steps
+    zip_int64_t bytes_read = 0;
+    do {
+        size_t size = content.size();
+        content.resize(size + LPM_ZIP_BUFFER_SIZE);
+
+        bytes_read = zip_fread(current_file, content.data() + size, LPM_ZIP_BUFFER_SIZE);
+        content.resize(size + std::max<zip_int64_t>(bytes_read, 0));
+    } while (bytes_read > 0);
+
+    zip_fclose(current_file);
+
+    if (bytes_read < 0) {
+        error = "Failed to read zip file entry " + std::to_string(index);
+
+        return false;
+    }
 
     return true;
 }
@@ -93,126 +194,81 @@ bool LPM::Utils::unzip(
     const std::string& dest_path,
     std::string& error
 ) {
-    char buffer[LPM_ZIP_BUFFER_SIZE];
-
     // Naturally, I'd use zip_file->nentry, but it's not available in the
     // zip.h header file.
     zip_uint64_t n_entries = static_cast<zip_uint64_t>(
         zip_get_num_entries(zip_file, 0)
     );
 
-    // Iterate over all files in the zip file
-    for (int i = 0; i < n_entries; i++) {
-        struct zip_stat sb;
-
-        if (zip_stat_index(zip_file, i, 0, &sb) != 0) {
-            error =
-                "Unable to retrieve file information from zip. (Index: " + std::to_string(i) + ")";
-
-            return false;
-        }
-
-        struct zip_file* zip_file_entry = zip_fopen_index(zip_file, i, 0);
-        if (!zip_file_entry) {
-            error = "Failed to open zip file entry";
-
-            return false;
-        }
+    // Every file is queued and written together at the end, whatever
+    // happens nothing is left queued
+    IO::Backend& io = IO::local();
+    scope_destructor<IO::Backend*, discard_batch> batch(&io);
 
+    // Iterate over all files in the zip file
+    for (zip_uint64_t i = 0; i < n_entries; i++) {
         // Get the file name
         const char* file_name = zip_get_name(zip_file, i, 0);
         if (!file_name) {
             error = "Failed to get zip file entry name";
 
-            // Close the zip file entry
-            zip_fclose(zip_file_entry);
-
             return false;
         }
 
         LPM_PRINT_DEBUG("Unzipping file: " << file_name);
 
-        // Create the full path
-        std::string file_path = dest_path + "/" + file_name;
-
-        // Create an empty file at the path
-        // (we use write_file because it handles directories)
-         if (!write_file(file_path, "")) {
-            error = "Failed to create file at path: " + file_path;
-
-            // Close the zip file entry
-            zip_fclose(zip_file_entry);
+        if (!safe_entry_name(file_name)) {
+            error = "Refusing to extract entry '" + std::string(file_name) + "' outside of " + dest_path;
 
             return false;
-         }
+        }
 
-        // Open the file via index
-        struct zip_file* current_file = zip_fopen_index(zip_file, i, 0);
-        if (!current_file) {
-            error = "Failed to open file at path: " + file_path;
+        // Create the full path
+        std::string file_path = dest_path + "/" + file_name;
 
-            // Close the zip file entry
-            zip_fclose(zip_file_entry);
+        if (file_path.back() == '/') {
+            io.directory(file_path);
+            continue;
+        }
 
+        std::string content;
+        if (!read_entry(zip_file, i, content, error) || !io.write(file_path, std::move(content), error)) {
             return false;
         }
+    }
 
-        // Open a file stream to the file_path
-        std::ofstream file(file_path, std::ios::app);
-        if (!file.is_open()) {
-            error = "Failed to open file: " + file_path;
+    return io.flush(error);
+}
 
-            // Close the current file
-            zip_fclose(current_file);
+bool LPM::Utils::safe_entry_name(std::string_view name) {
+    if (name.empty() || name[0] == '/' || name.find('\\') != std::string_view::npos) {
+        return false;
+    }
 
+    for (auto& segment : split(name, '/')) {
+        if (segment == "..") {
             return false;
         }
-
-        // Transfer data from the zip file to the file stream
-        int bytes_read = 0;
-        while (
-            // We cast buffer to a void pointer to allow libzip to perform
-            // casting of the buffer to any other data type
-            (bytes_read = zip_fread(current_file, static_cast<void*>(buffer), LPM_ZIP_BUFFER_SIZE))
-            > 0
-        ) {
-            // Write the buffer to the file
-            try {
-                file.write(buffer, bytes_read);
-            } catch (...) {
-                error = "Failed to write to file: " + file_path;
-
-                // Close the current file
-                zip_fclose(current_file);
-
-                return false;
-            }
-        }
-
-        // Finally close the file
-        file.close();
-
-        // Close the current file
-        zip_fclose(current_file);
-
-        // Close the zip file entry
-        zip_fclose(zip_file_entry);
-
-        LPM_PRINT_DEBUG("Unzipped file: " << file_name);
     }
 
     return true;
 }
 
-std::vector<std::string> LPM::Utils::split(
-    const std::string& str,
+void LPM::Utils::discard_batch(IO::Backend* io) {
+    io->discard();
+}
+
+std::vector<std::string_view> LPM::Utils::split(
+    std::string_view str,
     char delimiter
 ) {
-    std::vector<std::string> segments;
+    // Segments point into str, the vector is the only allocation
+    std::vector<std::string_view> segments;
+    segments.reserve(std::count(str.begin(), str.end(), delimiter) + 1);
 
     size_t start_pos = 0;
     size_t end_pos = str.find(delimiter);
-    while (end_pos != std::string::npos) {
+    while (end_pos != std::string_view::npos) {
         segments.push_back(str.substr(start_pos, end_pos - start_pos));
 
         start_pos = end_pos + 1;
@@ -248,4 +304,187 @@ std::string LPM::Utils::join(
     }
 
     return result;
-}
\ No newline at end of file
+}
+uint64_t LPM::Utils::hash(
+    const char* data,
+    size_t size,
+    uint64_t seed
+) {
+    uint64_t result = seed;
+
+    for (size_t i = 0; i < size; i++) {
+        result ^= static_cast<unsigned char>(data[i]);
+        result *= 1099511628211ULL;
+    }
+
+    return result;
+}
+
+std::string LPM::Utils::to_hex(uint64_t value) {
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+
+    return buffer;
+}
+
+void LPM::Utils::put_le(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+uint64_t LPM::Utils::get_le(const char* data, int bytes) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (i * 8);
+    }
+
+    return value;
+}
+
+std::string LPM::Utils::quote_lua(const std::string& str) {
+    std::string result = "\"";
+    result.reserve(str.size() + 2);
+
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c < 0x20 || c == 0x7f) {
+            // Always use three digits so a following digit isn't
+            // read as part of the escape
+            char escape[5];
+            std::snprintf(escape, sizeof(escape), "\\%03d", c);
+            result += escape;
+        } else {
+            result += c;
+        }
+    }
+
+    result += '"';
+
+    return result;
+}
+
+std::string LPM::Utils::quote_shell(const std::string& str) {
+    std::string result = "'";
+
+    for (char c : str) {
+        if (c == '\'') {
+            result += "'\\''";
+        } else {
+            result += c;
+        }
+    }
+
+    result += "'";
+
+    return result;
+}
+
+int LPM::Utils::run(const std::string& command, std::string& output) {
+    output.clear();
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        return -1;
+    }
+
+    char buffer[4096];
+    size_t bytes_read;
+    while ((bytes_read = std::fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+        output.append(buffer, bytes_read);
+    }
+
+    int status = pclose(pipe);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#else
+    return std::system(command.c_str());
+#endif
+}
+
+LPM::Utils::MappedFile::~MappedFile() {
+    close();
+}
+
+bool LPM::Utils::MappedFile::open(const std::string& path, std::string& error) {
+    close();
+
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    _descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_descriptor < 0) {
+        error = "Failed to open file '" + path + "': " + std::strerror(errno);
+
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(_descriptor, &sb) != 0) {
+        error = "Failed to stat file '" + path + "': " + std::strerror(errno);
+        close();
+
+        return false;
+    }
+
+    _size = static_cast<size_t>(sb.st_size);
+
+    // mmap refuses zero-length mappings, an empty file is simply empty
+    if (_size == 0) {
+        return true;
+    }
+
+    void* mapping = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _descriptor, 0);
+    if (mapping == MAP_FAILED) {
+        error = "Failed to map file '" + path + "': " + std::strerror(errno);
+        close();
+
+        return false;
+    }
+
+    _data = static_cast<const char*>(mapping);
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        error = "Failed to open file '" + path + "'";
+
+        return false;
+    }
+
+    _fallback.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+
+    if (!file.read(_fallback.data(), _fallback.size())) {
+        error = "Failed to read file '" + path + "'";
+        close();
+
+        return false;
+    }
+
+    _data = _fallback.data();
+    _size = _fallback.size();
+#endif
+
+    LPM_PRINT_DEBUG("Mapped file " << path << " (" << _size << " bytes)");
+
+    return true;
+}
+
+void LPM::Utils::MappedFile::close() {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+    if (_data) {
+        munmap(const_cast<char*>(_data), _size);
+    }
+
+    if (_descriptor >= 0) {
+        ::close(_descriptor);
+    }
+#endif
+
+    _fallback.clear();
+    _data = nullptr;
+    _size = 0;
+    _descriptor = -1;
+}
@@ -1,31 +1,67 @@
 #pragma once
 #include <zip.h>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
 #include <filesystem>
+#include "io.h"
 
 namespace LPM::Utils {
     namespace fs = std::filesystem;
 
     void format(
         std::string& format_str,
-        std::map<std::string, std::string> args
+        const std::map<std::string, std::string>& args
     );
 
+    // Create every missing directory above path
+    bool create_parent_directories(const std::string& path);
+
     bool write_file(
         const std::string& path,
         const std::string& content
     );
 
+    // A name next to path that no other process or thread picks, to
+    // write a file under before renaming it into place
+    std::string temporary_path(const std::string& path);
+
+    // Write content under a temporary name and rename it over path, so
+    // readers (other processes included) see the old file or the new
+    // one, never a partial one
+    bool replace_file(
+        const std::string& path,
+        const std::string& content
+    );
+
+    // Read a whole entry of an archive into content
+    bool read_entry(
+        zip* zip_file,
+        zip_uint64_t index,
+        std::string& content,
+        std::string& error
+    );
+
+    // Whether an archive entry name stays inside the destination: not
+    // empty or absolute, without backslashes or ".." segments
+    bool safe_entry_name(std::string_view name);
+
+    // Extract every entry, refusing the whole archive if any name is
+    // unsafe
     bool unzip(
         zip* zip_file,
         const std::string& dest_path,
         std::string& error
     );
 
-    std::vector<std::string> split(
-        const std::string& str,
+    // Drop whatever an I/O batch still holds, for scope_destructor
+    void discard_batch(IO::Backend* io);
+
+    // Segments are views into str, which must outlive them
+    std::vector<std::string_view> split(
+        std::string_view str,
         char delimiter
     );
 
@@ -35,4 +71,51 @@ namespace LPM::Utils {
         size_t start_index = 0,
         size_t end_index = std::string::npos
     );
+
+    // 64-bit FNV-1a, pass a previous result as seed to hash several buffers
+    uint64_t hash(
+        const char* data,
+        size_t size,
+        uint64_t seed = 14695981039346656037ULL
+    );
+
+    std::string to_hex(uint64_t value);
+
+    // Integers of `bytes` bytes in little-endian order, which every
+    // binary file lpm writes uses whatever the host byte order
+    void put_le(std::string& out, uint64_t value, int bytes);
+    uint64_t get_le(const char* data, int bytes);
+
+    // Quote a string as a Lua string literal
+    std::string quote_lua(const std::string& str);
+
+    // Quote a string as a single POSIX shell word
+    std::string quote_shell(const std::string& str);
+
+    // Run a shell command, collecting what it prints to stdout.
+    // Returns its exit status, or -1 if it couldn't be started.
+    int run(const std::string& command, std::string& output);
+
+    // A read-only view of a whole file, mapped into memory where the
+    // platform allows it (and read into a heap buffer otherwise)
+    class MappedFile {
+    public:
+        MappedFile() {}
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool open(const std::string& path, std::string& error);
+        void close();
+
+        const char* data() const { return _data; }
+        size_t size() const { return _size; }
+        int descriptor() const { return _descriptor; }
+    private:
+        const char* _data = nullptr;
+        size_t _size = 0;
+        int _descriptor = -1;
+        std::vector<char> _fallback;
+    };
 }
\ No newline at end of file
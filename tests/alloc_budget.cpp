@@ -0,0 +1,139 @@
+// Allocation budgets of the hot paths.
+//
+// Replaces the global operator new with one that counts, then runs each
+// operation and fails if it allocated more than its budget. Budgets are
+// upper bounds, lower them when a path gets cheaper.
+//
+//   lpm-alloc-budget
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <utility>
+#include "env.h"
+#include "requests.h"
+#include "scope_destructor.h"
+#include "utils.h"
+
+namespace {
+    thread_local size_t allocations = 0;
+    int failures = 0;
+
+    // Runs operation once and checks how many times it allocated
+    template <class F>
+    void budget(const char* name, size_t limit, F&& operation) {
+        size_t before = allocations;
+        operation();
+        size_t used = allocations - before;
+
+        if (used > limit) {
+            std::fprintf(stderr, "FAIL %s: %zu allocations, budget %zu\n", name, used, limit);
+            failures++;
+        } else {
+            std::printf("ok   %s: %zu/%zu\n", name, used, limit);
+        }
+    }
+
+    void release(int* value) {
+        (*value)++;
+    }
+}
+
+void* operator new(size_t size) {
+    allocations++;
+
+    if (void* pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+int main() {
+    setenv("LPM_BUDGET_SHORT", "short", 1);
+    setenv("LPM_BUDGET_NUMBER", "42", 1);
+
+    // Values and defaults fit the small string buffer
+    budget("Env::get set", 0, [] {
+        std::string value = LPM::Env::get("LPM_BUDGET_SHORT", "");
+    });
+
+    budget("Env::get default", 0, [] {
+        std::string value = LPM::Env::get("LPM_BUDGET_MISSING", "cc");
+    });
+
+    std::string key = "LPM_BUDGET_NUMBER";
+    budget("Env::get int", 0, [&] {
+        LPM::Env::get(key, 0);
+    });
+
+    // The vector of views, nothing per segment
+    budget("Utils::split", 1, [] {
+        auto segments = LPM::Utils::split("lua_modules/lpeg/src/re.lua", '/');
+    });
+
+    budget("Utils::safe_entry_name", 1, [] {
+        LPM::Utils::safe_entry_name("lpeg-1.1.0/src/lpeg.c");
+    });
+
+    // Arguments aren't copied, with enough capacity nothing grows
+    std::map<std::string, std::string> arguments = {
+        { "name", "lpeg" },
+        { "version", "1.1.0" }
+    };
+    std::string format_str;
+    format_str.reserve(128);
+    budget("Utils::format", 0, [&] {
+        format_str = "${name}-${version}.zip";
+        LPM::Utils::format(format_str, arguments);
+    });
+
+    budget("Utils::hash", 0, [] {
+        LPM::Utils::hash("lpeg-1.1.0.zip", 14);
+    });
+
+    // The body (usually large) is moved, not copied
+    std::string body(1 << 16, 'x');
+    std::string url = "https://luarocks.org/lpeg-1.1.0.zip";
+    budget("Response", 0, [&] {
+        LPM::Requests::Response response(std::move(body), std::move(url), 200);
+    });
+
+    int released = 0;
+    budget("scope_destructor", 0, [&] {
+        LPM::scope_destructor<int*, release> guard(&released);
+    });
+
+    static_assert(
+        sizeof(LPM::scope_destructor<int*, release>) <= 2 * sizeof(int*),
+        "scope_destructor should hold nothing but the object and a flag"
+    );
+
+    if (released != 1) {
+        std::fprintf(stderr, "FAIL scope_destructor: destructor ran %d times\n", released);
+        failures++;
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,163 @@
+// Differential check of the manifest parsers.
+//
+// Loads every packages.toml and lpm.toml of a corpus twice, through the
+// Schema fast path and through toml11 alone, and fails if the results
+// differ: other fields, or another error. Files under <corpus>/packages
+// are package manifests, files under <corpus>/config are configs.
+//
+//   lpm-manifest-diff <corpus>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include "manifests.h"
+#include "schema.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct Totals {
+        size_t files = 0, fast = 0, failures = 0;
+    };
+
+    template <class Manifest>
+    struct Outcome {
+        std::optional<Manifest> manifest;
+        std::string error;
+    };
+
+    template <class Manifest>
+    Outcome<Manifest> load(const std::string& path, bool use_schema) {
+        Outcome<Manifest> outcome;
+
+        try {
+            outcome.manifest.emplace(path, use_schema);
+        } catch (const std::exception& e) {
+            outcome.error = e.what();
+        }
+
+        return outcome;
+    }
+
+    void describe(std::ostream& out, const std::map<std::string, std::string>& map) {
+        for (auto& entry : map) {
+            out << " " << entry.first << "=" << LPM::Utils::quote_lua(entry.second);
+        }
+        out << "\n";
+    }
+
+    std::string describe(const LPM::Manifests::Packages& packages) {
+        std::stringstream out;
+        out
+            << "name " << packages.name << "\nversion " << packages.version
+            << "\ndescription " << packages.description << "\nauthor " << packages.author
+            << "\nlicense " << packages.license << "\nhomepage " << packages.homepage
+            << "\nrepository " << packages.repository << "\nmain " << packages.main
+            << "\nlua_version " << packages.lua_version << "\ndependencies";
+        describe(out, packages.dependencies);
+
+        return out.str();
+    }
+
+    std::string describe(const LPM::Manifests::Config& config) {
+        std::stringstream out;
+        out
+            << "db_backend " << config.db_backend << "\npackages_db " << config.packages_db
+            << "\nrepositories_cache " << config.repositories_cache
+            << "\npackages_cache " << config.packages_cache
+            << "\nmodules_path " << config.modules_path
+            << "\ncache " << config.cache_max_size_mb << " " << config.cache_max_age_days
+            << "\nluas";
+        describe(out, config.luas);
+        out << "lua_includes";
+        describe(out, config.lua_includes);
+        for (auto& source : config.repositories) {
+            out << "sources." << source.first;
+            describe(out, source.second);
+        }
+
+        return out.str();
+    }
+
+    // Whether the fast path handled the file by itself, so the corpus
+    // can't silently end up testing toml11 against itself
+    bool schema_accepts(const std::string& path, LPM::Manifests::Packages packages) {
+        LPM::Utils::MappedFile file;
+        std::string error;
+
+        return file.open(path, error) && LPM::Schema::packages(file.data(), file.size(), packages);
+    }
+
+    bool schema_accepts(const std::string& path, LPM::Manifests::Config config) {
+        LPM::Utils::MappedFile file;
+        std::string error;
+        bool has_luas, has_sources;
+
+        return file.open(path, error) &&
+            LPM::Schema::config(file.data(), file.size(), config, has_luas, has_sources);
+    }
+
+    template <class Manifest>
+    void check(const fs::path& directory, Totals& totals) {
+        for (auto& entry : fs::directory_iterator(directory)) {
+            if (entry.path().extension() != ".toml") {
+                continue;
+            }
+
+            std::string path = entry.path().string();
+            auto fast = load<Manifest>(path, true);
+            auto reference = load<Manifest>(path, false);
+
+            std::string got = fast.manifest ? describe(*fast.manifest) : "error: " + fast.error;
+            std::string expected = reference.manifest ? describe(*reference.manifest) : "error: " + reference.error;
+
+            totals.files++;
+            if (fast.manifest && schema_accepts(path, *fast.manifest)) {
+                totals.fast++;
+            }
+
+            if (got != expected) {
+                std::cerr
+                    << "MISMATCH " << path << "\n"
+                    << "schema:\n" << got << "\n"
+                    << "toml11:\n" << expected << "\n";
+                totals.failures++;
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <corpus>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    fs::path corpus = argv[1];
+    Totals packages, config;
+
+    try {
+        check<LPM::Manifests::Packages>(corpus / "packages", packages);
+        check<LPM::Manifests::Config>(corpus / "config", config);
+    } catch (const fs::filesystem_error& e) {
+        std::cerr << "Failed to read corpus: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout
+        << "packages: " << packages.files << " files, " << packages.fast << " through the fast path, "
+        << packages.failures << " mismatches\n"
+        << "config:   " << config.files << " files, " << config.fast << " through the fast path, "
+        << config.failures << " mismatches\n";
+
+    if (packages.fast == 0 || config.fast == 0) {
+        std::cerr << "The fast path handled no file of a kind, the corpus tests nothing" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return packages.failures + config.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
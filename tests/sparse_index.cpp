@@ -0,0 +1,136 @@
+// Sparse repositories end to end.
+//
+// Generates the sparse layout of a small repository, serves it with the
+// mock registry of the install benchmark and resolves dependencies
+// through Sparse::Index: fetching, revalidation with ETag, the offline
+// cache, missing packages and versions, and a broken response that must
+// not replace the cached copy.
+//
+//   lpm-sparse-index
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+#include "manifests.h"
+#include "mock_registry.h"
+#include "sparse.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    int failures = 0;
+
+    void check(const char* name, bool passed, const std::string& detail = "") {
+        if (passed) {
+            std::printf("ok   %s\n", name);
+        } else {
+            std::fprintf(stderr, "FAIL %s %s\n", name, detail.c_str());
+            failures++;
+        }
+    }
+
+    const char* REPOSITORY =
+        "[repository]\n"
+        "name = \"test\"\n"
+        "summary = \"Sparse test repository\"\n"
+        "\n"
+        "[packages.a]\n"
+        "summary = \"One letter\"\n"
+        "package_type = \"zip\"\n"
+        "versions = { \"0.1.0\" = \"https://example.com/a-0.1.0.zip\" }\n"
+        "\n"
+        "[packages.lfs]\n"
+        "summary = \"Three letters\"\n"
+        "package_type = \"source\"\n"
+        "versions = { \"1.8.0\" = \"https://example.com/lfs-1.8.0.zip\" }\n"
+        "\n"
+        "[packages.lpeg]\n"
+        "summary = \"Parsing expression grammars\"\n"
+        "package_type = \"source\"\n"
+        "versions = { \"1.0.2\" = \"https://example.com/lpeg-1.0.2.zip\", "
+        "\"1.1.0\" = \"https://example.com/lpeg-1.1.0.zip\" }\n";
+}
+
+int main() {
+    fs::path root = fs::temp_directory_path() / ("lpm-sparse-index-" + std::to_string(getpid()));
+    fs::path served = root / "served", cache = root / "cache";
+    std::string error;
+
+    if (!LPM::Utils::write_file((root / "repository.toml").string(), REPOSITORY)) {
+        std::fprintf(stderr, "Failed to write the test repository under %s\n", root.c_str());
+        return EXIT_FAILURE;
+    }
+
+    LPM::Manifests::Repository repository((root / "repository.toml").string());
+    check("generate", LPM::Sparse::generate(repository, served.string(), error), error);
+    check("generate shards", fs::exists(served / "1" / "a.toml") && fs::exists(served / "3" / "l" / "lfs.toml") &&
+        fs::exists(served / "lp" / "eg" / "lpeg.toml"));
+
+    LPM::Bench::RegistryOptions options;
+    options.packages = 0;
+    options.root = served.string();
+    LPM::Bench::MockRegistry registry(options);
+
+    {
+        LPM::Sparse::Index index(registry.root_url() + "/", cache.string());
+
+        error.clear();
+        check("resolve", index.resolve({ { "a", "0.1.0" }, { "lfs", "1.8.0" }, { "lpeg", "1.1.0" } }, error), error);
+
+        auto lpeg = index.packages.find("lpeg");
+        check("resolve fetched", index.packages.size() == 3 && lpeg != index.packages.end() &&
+            lpeg->second.summary == "Parsing expression grammars" && lpeg->second.versions.size() == 2);
+
+        error.clear();
+        check("missing version", !index.resolve({ { "lpeg", "9.9.9" } }, error) &&
+            error.find("no version") != std::string::npos, error);
+
+        error.clear();
+        check("missing package", !index.get("luasocket", error) &&
+            error.find("was not found") != std::string::npos, error);
+
+        error.clear();
+        check("invalid name", !index.get("../lpeg", error) && !index.get("lp..eg", error));
+    }
+
+    // A second index revalidates what the first one cached
+    {
+        LPM::Sparse::Index index(registry.root_url(), cache.string());
+        std::uint64_t before = registry.not_modified;
+
+        error.clear();
+        check("revalidate", index.get("lpeg", error) && registry.not_modified == before + 1, error);
+    }
+
+    {
+        LPM::Sparse::Index index("http://127.0.0.1:1", cache.string());
+        index.offline = true;
+
+        error.clear();
+        auto a = index.get("a", error);
+        check("offline", a && a->versions.contains("0.1.0"), error);
+    }
+
+    // The served file changes (so does its ETag) into something that
+    // isn't TOML: the cached copy stays and keeps being used
+    LPM::Utils::write_file((served / "lp" / "eg" / "lpeg.toml").string(), "versions = [\n");
+    {
+        LPM::Sparse::Index index(registry.root_url(), cache.string());
+
+        error.clear();
+        auto lpeg = index.get("lpeg", error);
+        check("broken response", lpeg && lpeg->versions.contains("1.1.0"), error);
+
+        index.offline = true;
+        index.packages.clear();
+        lpeg = index.get("lpeg", error);
+        check("broken response kept cache", lpeg && lpeg->versions.contains("1.0.2"), error);
+    }
+
+    std::error_code remove_error;
+    fs::remove_all(root, remove_error);
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}